@@ -26,335 +26,1464 @@
 #include <cmath>
 #include <time.h>
 #include <iostream>
+#include <string.h>
+#include <chrono>
+#include <climits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "ucr_block.h"
+#include "ucr_dtw.h"
+#include "ucr_prof.h"
 
-#define min(x,y) ((x)<(y)?(x):(y))
-#define max(x,y) ((x)>(y)?(x):(y))
-#define dist(x,y) ((x-y)*(x-y))
+using namespace std;
 
-#define INF 1e20       //Pseudo Infitinte number for this code
+void error(int id);
+
+/// Data source of the main loop: the original two-column text file,
+/// or a block file written by UCR_PACK (see ucr_block.h).
+typedef struct Source
+    {   FILE        *fp;
+        int          blocked;    /// 1 for a block file
+        BlockHeader  hdr;
+        double      *x, *y;      /// data of the current block
+        int          len, pos;   /// size of the current block and the next point in it
+        long long    b;          /// next block to be read
+        long long    next;       /// global index of the next point
+        long long    end;        /// no points are read from here on
+        uint64_t    *slot;       /// scan of a quantized file: the records of the last nslot blocks
+        long long   *slotb;      /// read, block b in slot b%nslot of words each, and the block in
+        int          nslot, words;   /// each slot, -1 for none; see source_codes
+        long long    xb;         /// block in x, y decoded by source_exact, -1 for none
+    } Source;
+
+/// Visiting order of the data, see -order
+#define ORDER_FILE    0
+#define ORDER_STRIDE  1
+#define ORDER_RANDOM  2
+
+/// Read the next point; return 0 when all data has been read.
+int next_point(Source *s, double *d, double *dA)
+{
+    if (s->next >= s->end)
+        return 0;
+    if (!s->blocked)
+    {
+        if (fscanf(s->fp,"%lf\t%lf", d, dA) == EOF)
+            return 0;
+        s->next++;
+        return 1;
+    }
+    if (s->pos == s->len)
+    {
+        if (s->b >= s->hdr.nblocks)
+            return 0;
+        s->len = block_read(s->fp, &s->hdr, s->b++, s->x, s->y);
+        s->xb = -1;
+        s->pos = 0;
+        if (s->len == 0)
+            return 0;
+    }
+    *d = s->x[s->pos];
+    *dA = s->y[s->pos];
+    s->pos++;
+    s->next++;
+    return 1;
+}
 
-using namespace std;
+/// Read up to n points into x and y, from one block at most; return 0 when all data has been read.
+/// A whole block that fits is read and decoded straight into x and y, not through s->x.
+int source_read(Source *s, double *x, double *y, int n)
+{
+    if (!s->blocked)
+        return next_point(s, x, y);
+    if (s->next >= s->end)
+        return 0;
+    if (s->pos == s->len)
+    {
+        if (s->b >= s->hdr.nblocks)
+            return 0;
+        int c = block_count(&s->hdr, s->b);
+        if (c <= n && s->next + c <= s->end)
+        {
+            if (block_read(s->fp, &s->hdr, s->b, x, y) != c)
+                return 0;
+            s->b++;
+            s->next += c;
+            s->len = s->pos = c;
+            return c;
+        }
+        s->len = block_read(s->fp, &s->hdr, s->b++, s->x, s->y);
+        s->xb = -1;
+        s->pos = 0;
+        if (s->len == 0)
+            return 0;
+    }
+    int c = (int)min((long long)min(n, s->len - s->pos), s->end - s->next);
+    memcpy(x, s->x + s->pos, sizeof(double)*c);
+    memcpy(y, s->y + s->pos, sizeof(double)*c);
+    s->pos += c;
+    s->next += c;
+    return c;
+}
+
+/// Lower bound of DTW between the sorted query qs (low to high) and any z-normalized
+/// subsequence whose values span at most W.
+/// The values of such a subsequence lie in some [a,a+W] with a <= 0 <= a+W, so
+///  - every query point is at least |q|-W away from all of them, and
+///  - the pair qs[m-1-k], qs[k] costs at least (qs[m-1-k]-qs[k]-W)^2/2 together.
+/// Both sums are lower bounds; the larger one is returned.
+double lb_range(double *qs, int m, double W)
+{
+    double pairs = 0, points = 0, g;
+    for (int k = 0; k < m/2; k++)
+    {
+        g = qs[m-1-k] - qs[k] - W;
+        if (g <= 0)
+            break;
+        pairs += g*g/2;
+    }
+    for (int k = 0; k < m; k++)
+    {
+        g = fabs(qs[k]) - W;
+        if (g > 0)
+            points += g*g;
+    }
+    return max(pairs, points);
+}
+
+/// Block level lower bound for one dimension d.
+/// glb[s] bounds DTW for every subsequence starting in block s. Such a subsequence lies inside
+/// blocks s..s+span, so its values are within [lo,hi] of those blocks. It also contains at least
+/// nf full consecutive blocks; by the law of total variance its variance is at least nf*B/m times
+/// the variance of those blocks together. Hence its z-normalized values span at most
+/// W = (hi-lo)/std_lo, and lb_range gives the bound.
+/// A constant group has no z-normalization at all and can never be a match.
+void block_bounds(BlockHeader *h, BlockSummary *sum, int d, double *qs, int m, double *glb)
+{
+    long long nb = h->nblocks;
+    int B = h->block_size;
+    int span = (B+m-2)/B;
+    int nf = (m-B+1)/B;
+    long long s, k, e, x;
+    double lo, hi, S, S2, var, minvar;
+
+    for (s = 0; s < nb; s++)
+    {
+        e = min(nb-1, s+span);
+        lo = sum[s].min[d];
+        hi = sum[s].max[d];
+        for (k = s+1; k <= e; k++)
+        {
+            lo = min(lo, sum[k].min[d]);
+            hi = max(hi, sum[k].max[d]);
+        }
+        if (hi == lo)
+        {   glb[s] = INF;
+            continue;
+        }
+
+        minvar = INF;
+        for (k = s; nf > 0 && k+nf-1 <= e; k++)
+        {
+            S = S2 = 0;
+            for (x = k; x < k+nf && block_count(h, x) == B; x++)
+            {   S += sum[x].sum[d];
+                S2 += sum[x].sum2[d];
+            }
+            if (x < k+nf)
+                continue;
+            S /= (double)nf*B;
+            S2 /= (double)nf*B;
+            /// margin for the cancellation error in S2-S*S
+            var = S2 - S*S - 1e-12*S2;
+            minvar = min(minvar, var);
+        }
+        if (minvar < INF && minvar > 0)
+            glb[s] = lb_range(qs, m, (hi-lo)/sqrt(minvar*nf*B/m));
+        else
+            glb[s] = 0;
+    }
+}
+
+/// Go back to the first point of the data
+void source_rewind(Source *s)
+{
+    if (s->blocked)
+    {   s->b = 0;
+        s->len = s->pos = 0;
+        s->xb = -1;
+    }
+    else
+        rewind(s->fp);
+    s->next = 0;
+}
+
+/// The record of block b of a quantized file in its slot, read unless it is there already;
+/// c gets the number of points in it
+uint64_t *source_record(Source *s, long long b, int *c)
+{
+    int k = (int)(b % s->nslot);
+    uint64_t *rec = s->slot + (size_t)k*s->words;
+    *c = block_count(&s->hdr, b);
+    if (s->slotb[k] != b)
+    {   if (block_read_record(s->fp, &s->hdr, b, rec) != *c)
+            error(2);
+        s->slotb[k] = b;
+    }
+    return rec;
+}
+
+/// Position a block file source at global index p and read no further than end
+void source_seek(Source *s, long long p, long long end)
+{
+    s->b = p/s->hdr.block_size;
+    s->len = s->pos = 0;
+    if (p < s->hdr.n)
+    {   if (s->slot != NULL)
+            source_record(s, s->b++, &s->len);
+        else
+            s->len = block_read(s->fp, &s->hdr, s->b++, s->x, s->y);
+        s->xb = -1;
+        s->pos = (int)(p - (s->b-1)*s->hdr.block_size);
+        if (s->len == 0)
+            error(2);
+    }
+    s->next = p;
+    s->end = end;
+}
 
-/// Data structure for sorting the query
-typedef struct Index
-    {   double value;
-        int    index;
-    } Index;
+/// Grid of the codes of a chunk of a quantized file, with the points from..to-1: one scale and
+/// offset per dimension for all of its blocks, from the range of their summaries, as a block
+/// gets it from the range of its values. The grid of a block is thus as fine or finer.
+/// z-normalization takes scale and offset out again, so the bounds run on the codes as they are.
+void chunk_grid(Source *s, BlockSummary *sum, long long from, long long to, BlockQuant *g)
+{
+    int B = s->hdr.block_size;
+    for (int d = 0; d < 2; d++)
+    {
+        double lo = INF, hi = -INF;
+        for (long long b = from/B; b <= (to-1)/B && b < s->hdr.nblocks; b++)
+        {   lo = min(lo, sum[b].min[d]);
+            hi = max(hi, sum[b].max[d]);
+        }
+        if (lo > hi)
+            lo = hi = 0;
+        quant_grid(lo, hi, 65535, &g->scale[d], &g->offset[d]);
+        g->err[d] = 0;
+    }
+}
+
+/// The errors of a chunk from the first lossy point on: the n points before it get 0
+static inline void chunk_lossy(double *e, double *eA, int n, bool *lossy)
+{
+    if (!*lossy)
+    {   memset(e, 0, sizeof(double)*n);
+        memset(eA, 0, sizeof(double)*n);
+        *lossy = true;
+    }
+}
+
+/// Copy the n points from global index p on into the chunk codes x, y from position at on, on
+/// the grid g; their blocks are in the slots. A block on the grid of the chunk only moves its
+/// codes by the difference of the offsets, one on a finer grid is rounded to it, as is a lossy
+/// value half a step outside the range of the grid.
+/// Once a point of the chunk is lossy, e and eA get the squared error bound of every point in
+/// steps of g, and *lossy is set.
+void chunk_codes(Source *s, long long p, int n, const BlockQuant *g, int16_t *x, int16_t *y, int at,
+                 double *e, double *eA, bool *lossy)
+{
+    int B = s->hdr.block_size;
+    int16_t *v[2] = { x+at, y+at };
+    double *ev[2] = { e+at, eA+at };
+    BlockQuant bq;
+
+    for (int k = 0; k < n; )
+    {
+        long long b = (p+k)/B;
+        int c, o = (int)(p+k - b*B);
+        uint64_t *rec = source_record(s, b, &c);
+        int len = min(c-o, n-k);
+        memcpy(&bq, rec, sizeof(bq));
+        for (int d = 0; d < 2; d++)
+        {
+            const int16_t *code = quant_codes(rec) + d*c + o;
+            int16_t *out = v[d] + k;
+            double *err = ev[d] + k;
+            double shift = (bq.offset[d] - g->offset[d])/g->scale[d];
+            int over = 1;
+            if (bq.scale[d] == g->scale[d] && shift == floor(shift) && fabs(shift) < 65536 &&
+                fabs(g->offset[d]/g->scale[d]) < 4503599627370496.0)
+            {
+                int sh = (int)shift;
+                over = 0;
+                for (int i = 0; i < len; i++)
+                {   int c2 = code[i] + sh;
+                    over |= (c2 < -32768) | (c2 > 32767);
+                    out[i] = (int16_t)c2;
+                }
+            }
+            if (!over)
+            {
+                if (bq.err[d] > 0)
+                    chunk_lossy(e, eA, at+k+len, lossy);
+                if (*lossy)
+                {   double q = bq.err[d]/g->scale[d];
+                    for (int i = 0; i < len; i++)
+                        err[i] = q*q;
+                }
+            }
+            else
+                for (int i = 0; i < len; i++)
+                {
+                    double dv = bq.offset[d] + bq.scale[d]*code[i];
+                    double cg = floor((dv - g->offset[d])/g->scale[d] + 0.5);
+                    cg = cg < -32768 ? -32768 : (cg > 32767 ? 32767 : cg);
+                    out[i] = (int16_t)cg;
+                    double q = (bq.err[d] + fabs(dv - (g->offset[d] + g->scale[d]*cg)))/g->scale[d];
+                    if (q > 0)
+                        chunk_lossy(e, eA, at+k+len, lossy);
+                    if (*lossy)
+                        err[i] = q*q;
+                }
+        }
+        k += len;
+    }
+}
 
-/// Data structure (circular array) for finding minimum and maximum for LB_Keogh envolop
-struct deque
-{   int *dq;
-    int size,capacity;
-    int f,r;
-};
+/// Read up to n points of a quantized file into the chunk codes x, y at position at, on the
+/// grid g, from one block at most, as source_read does for values; returns 0 when all data has
+/// been read. The records stay in the slots for the points the next chunk starts with, and
+/// for source_exact.
+int source_codes(Source *s, const BlockQuant *g, int16_t *x, int16_t *y, int at, int n,
+                 double *e, double *eA, bool *lossy)
+{
+    if (s->next >= s->end)
+        return 0;
+    if (s->pos == s->len)
+    {
+        if (s->b >= s->hdr.nblocks)
+            return 0;
+        source_record(s, s->b++, &s->len);
+        s->pos = 0;
+    }
+    int c = (int)min((long long)min(n, s->len - s->pos), s->end - s->next);
+    chunk_codes(s, s->next, c, g, x, y, at, e, eA, lossy);
+    s->pos += c;
+    s->next += c;
+    return c;
+}
 
+/// The exact values of the m points from global index p on into x, y, from the slots of a
+/// quantized file being scanned; a block is decoded as a whole and kept in s->x, s->y.
+void source_exact(Source *s, long long p, int m, double *x, double *y)
+{
+    int B = s->hdr.block_size;
+    for (int k = 0; k < m; )
+    {
+        long long b = (p+k)/B;
+        int c, o = (int)(p+k - b*B);
+        uint64_t *rec = source_record(s, b, &c);
+        if (b != s->xb)
+        {   block_decode(rec, c, s->x, s->y, s->hdr.pack);
+            s->xb = b;
+        }
+        int len = min(c-o, m-k);
+        memcpy(x+k, s->x+o, sizeof(double)*len);
+        memcpy(y+k, s->y+o, sizeof(double)*len);
+        k += len;
+    }
+}
 
-/// Sorting function for the query, sort by abs(z_norm(q[i])) from high to low
-int comp(const void *a, const void* b)
-{   Index* x = (Index*)a;
-    Index* y = (Index*)b;
-    return abs(y->value) - abs(x->value);   // high to low
+/// best-so-far for lower bounds on quantized data.
+/// If the values of a subsequence are off by errors of L2 norm E, its z-normalized values are
+/// at most 2*E/std off in the L2 norm, with std from the quantized values. A warping path with
+/// window r visits each point at most 2r+1 times, so sqrt(DTW) of the quantized and the original
+/// subsequence differ by at most sqrt(e2) with e2 = (2r+1)*4*(E/std)^2 summed over both
+/// dimensions. A bound of at least (sqrt(bsf)+sqrt(e2))^2 on the quantized data thus means
+/// DTW >= bsf on the original one.
+static inline double widen(double bsf, double e2)
+{
+    if (e2 == 0 || bsf >= INF)
+        return bsf;
+    double s = sqrt(bsf) + sqrt(e2);
+    return s*s;
 }
 
-/// Initial the queue at the begining step of envelop calculation
-void init(deque *d, int capacity)
+/// Order in which the segments 0..nseg-1 are visited.
+/// Stride: segment k*g mod nseg, with g coprime to nseg near the golden ratio of nseg, so
+/// every prefix of the order is spread about evenly over the series.
+/// Random: a fixed pseudo random permutation, the same in every run.
+long long *segment_order(long long nseg, int order)
 {
-    d->capacity = capacity;
-    d->size = 0;
-    d->dq = (int *) malloc(sizeof(int)*d->capacity);
-    d->f = 0;
-    d->r = d->capacity-1;
+    long long *seg = (long long *)malloc(sizeof(long long)*nseg);
+    long long k, g, a, b, tmp;
+
+    if (seg == NULL)
+        error(1);
+    if (order == ORDER_RANDOM)
+    {
+        srand(1);
+        for (k = 0; k < nseg; k++)
+            seg[k] = k;
+        for (k = nseg-1; k > 0; k--)
+        {   a = ((long long)rand()*RAND_MAX + rand()) % (k+1);
+            tmp = seg[k];  seg[k] = seg[a];  seg[a] = tmp;
+        }
+        return seg;
+    }
+    for (g = max(1, (long long)(nseg*0.6180339887)); g > 1; g--)
+    {   for (a = nseg, b = g; b != 0; )
+        {   tmp = a % b;  a = b;  b = tmp;
+        }
+        if (a == 1)
+            break;
+    }
+    for (k = 0; k < nseg; k++)
+        seg[k] = k*g % nseg;
+    return seg;
 }
 
-/// Destroy the queue
-void destroy(deque *d)
+/// All state of a search lives in one allocation, handed out in pieces aligned to cache lines.
+/// The size is worked out in advance (see window_bytes, query_bytes and main), so nothing
+/// is allocated or freed one by one.
+#define ARENA_ALIGN 64
+typedef struct Arena
+    {   char   *base;
+        size_t  size, used;
+    } Arena;
+
+/// Bytes taken by a piece of n bytes
+size_t arena_piece(size_t n)
 {
-    free(d->dq);
+    return (n + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
 }
 
-/// Insert to the queue at the back
-void push_back(struct deque *d, int v)
+/// An anonymous mapping, which the kernel zeroes page by page on first touch, so pieces that
+/// are never used (blocks bounds of a text file, the tail of a short last chunk) cost nothing
+void arena_init(Arena *A, size_t size)
 {
-    d->dq[d->r] = v;
-    d->r--;
-    if (d->r < 0)
-        d->r = d->capacity-1;
-    d->size++;
+    A->size = arena_piece(size);
+    A->used = 0;
+    A->base = (char *)mmap(NULL, A->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( A->base == MAP_FAILED )
+        error(1);
 }
 
-/// Delete the current (front) element from queue
-void pop_front(struct deque *d)
+void arena_free(Arena *A)
 {
-    d->f--;
-    if (d->f < 0)
-        d->f = d->capacity-1;
-    d->size--;
+    munmap(A->base, A->size);
 }
 
-/// Delete the last element from queue
-void pop_back(struct deque *d)
+void *arena_alloc(Arena *A, size_t n)
 {
-    d->r = (d->r+1)%d->capacity;
-    d->size--;
+    void *p = A->base + A->used;
+    A->used += arena_piece(n);
+    if (A->used > A->size)
+        error(1);
+    return p;
 }
 
-/// Get the value at the current position of the circular queue
-int front(struct deque *d)
+/// Envelope of the current chunk for one warping window r. It depends on r and the data only,
+/// so all windows of that r, of any query length or query of a set, share it.
+/// The chunk of a quantized file is kept as codes, and so is its envelope.
+typedef struct Envelope
+    {   int        r;
+        double    *l, *u, *lA, *uA;
+        int16_t   *cl, *cu, *clA, *cuA;
+    } Envelope;
+
+/// Everything that depends on the warping window; a sweep over several R has one per R.
+/// The windows are kept sorted from narrow to wide.
+typedef struct Window
+    {   double     R;
+        int        r, w;                       /// warping window and PAA segment width
+        double    *l, *u, *lA, *uA;            /// envelope of the query
+        SortedPoint *so, *soA;                 /// the query in sorted order with this envelope, for LB_Keogh
+        SortedPoint *so2, *soA2;               /// and for LB_Keogh2 on the data envelope
+        double    *pl, *pu, *plA, *puA;        /// PAA envelope of the query
+        Envelope  *env;                        /// envelope of the current chunk
+        Kernels    K;                          /// DTW for this m and r
+        double     bsf, bsfd, bsfdA;           /// best-so-far and the DTW of each dimension there
+        long long  loc;
+        double     seed, seedbsf;
+        long long  seedloc;
+        double     shown;                      /// best-so-far last printed by the anytime search
+        long long  kim, paa, keogh, keogh2, wider, dtwc, blk;
+        long long  grp;                        /// pruned by the union envelope of the cluster, see Group
+        int        id;                         /// position of R in the list of the command line
+        int        file;                       /// data file of loc, in a sharded search
+    } Window;
+
+/// Arena space of one window
+size_t window_bytes(int m)
 {
-    int aux = d->f - 1;
+    return 8*arena_piece(sizeof(double)*m) + 4*arena_piece(sizeof(SortedPoint)*m);
+}
 
-    if (aux < 0)
-        aux = d->capacity-1;
-    return d->dq[aux];
+/// Warping window of the query length m for R, a fraction of m if at most 1, else points
+int window_r(double R, int m)
+{
+    return R <= 1 ? floor(R*m) : floor(R);
 }
 
-/// Get the value at the last position of the circular queueint back(struct deque *d)
-int back(struct deque *d)
+/// Arena space of n chunk envelopes, of codes if quant
+size_t envelope_bytes(int n, int EPOCH, bool quant)
 {
-    int aux = (d->r+1)%d->capacity;
-    return d->dq[aux];
+    return arena_piece(sizeof(Envelope)*n) +
+           4*(size_t)n*arena_piece((quant ? sizeof(int16_t) : sizeof(double))*EPOCH);
 }
 
-/// Check whether or not the queue is empty
-int empty(struct deque *d)
+/// Sorted records so of the query q with the envelope l, u, in the order order of its positions
+void sort_records(SortedPoint *so, double *q, double *l, double *u, int *order, int m)
 {
-    return d->size == 0;
+    for (int i = 0; i < m; i++)
+    {   so[i].order = order[i];
+        so[i].qo = q[order[i]];
+        so[i].uo = u[order[i]];
+        so[i].lo = l[order[i]];
+    }
 }
 
-/// Finding the envelop of min and max value for LB_Keogh
-/// Implementation idea is intoruduced by Danial Lemire in his paper
-/// "Faster Retrieval with a Two-Pass Dynamic-Time-Warping Lower Bound", Pattern Recognition 42(9), 2009.
-void lower_upper_lemire(double *t, int len, int r, double *l, double *u)
+/// Build the envelopes of the query for warping window r; the chunk envelopes are set up
+/// later, see envelope_init. w is the PAA segment width, -1 to choose it from m and r.
+void window_init(Arena *A, Window *W, double R, int r, int w, double *q, double *qA, int *order, int *orderA,
+                 int m)
 {
-    struct deque du, dl;
+    memset(W, 0, sizeof(Window));
+    W->R = R;
+    W->r = r;
+    W->K = kernels_select(m, r);
+    W->l = (double *)arena_alloc(A, sizeof(double)*m);
+    W->u = (double *)arena_alloc(A, sizeof(double)*m);
+    W->lA = (double *)arena_alloc(A, sizeof(double)*m);
+    W->uA = (double *)arena_alloc(A, sizeof(double)*m);
+    W->pl = (double *)arena_alloc(A, sizeof(double)*m);
+    W->pu = (double *)arena_alloc(A, sizeof(double)*m);
+    W->plA = (double *)arena_alloc(A, sizeof(double)*m);
+    W->puA = (double *)arena_alloc(A, sizeof(double)*m);
+    W->so = (SortedPoint *)arena_alloc(A, sizeof(SortedPoint)*m);
+    W->soA = (SortedPoint *)arena_alloc(A, sizeof(SortedPoint)*m);
+    W->so2 = (SortedPoint *)arena_alloc(A, sizeof(SortedPoint)*m);
+    W->soA2 = (SortedPoint *)arena_alloc(A, sizeof(SortedPoint)*m);
+
+    /// Create envelop of the query: lower envelop, l, and upper envelop, u
+    lower_upper_lemire(q, m, r, W->l, W->u);
+    lower_upper_lemire(qA, m, r, W->lA, W->uA);
+    sort_records(W->so, q, W->l, W->u, order, m);
+    sort_records(W->soA, qA, W->lA, W->uA, orderA, m);
+    sort_records(W->so2, q, W->l, W->u, order, m);
+    sort_records(W->soA2, qA, W->lA, W->uA, orderA, m);
+
+    /// PAA segments are about sqrt(m) wide, but not much wider than the warping window,
+    /// where the segment envelope starts to be looser than the point envelope.
+    if (w < 0)
+        w = max(2, min((int)sqrt((double)m), max(2, r)));
+    W->w = min(w, m);
+    if (W->w > 0)
+    {   paa_envelope(W->l, W->u, m, W->w, W->pl, W->pu);
+        paa_envelope(W->lA, W->uA, m, W->w, W->plA, W->puA);
+    }
 
-    init(&du, 2*r+2);
-    init(&dl, 2*r+2);
+    W->bsf = W->bsfd = W->bsfdA = W->seed = W->seedbsf = W->shown = INF;
+    W->seedloc = -1;
+}
 
-    push_back(&du, 0);
-    push_back(&dl, 0);
+/// Sort windows by r, narrow first
+int comp_window(const void *a, const void *b)
+{
+    return ((Window *)a)->r - ((Window *)b)->r;
+}
 
-    for (int i = 1; i < len; i++)
+/// Everything that depends on the query length; a range of lengths has one per m.
+typedef struct Query
+    {   int        m;
+        double    *q, *qA;                     /// z-normalized query
+        double     ex, ex2, exA, ex2A;         /// running sums, see query_stats
+        long long  ahead, added;               /// starts of the chunk with mean and std, points summed
+        double     mu[KIM_LANES], sd[KIM_LANES], muA[KIM_LANES], sdA[KIM_LANES];   /// by start modulo KIM_LANES
+        double     kim[KIM_LANES];             /// LB_Kim of the group of starts from kimgroup on,
+        unsigned   kimmask;                    /// and which of them may survive
+        long long  kimgroup;
+        double    *glb, *glbA;                 /// block level lower bounds of a block file
+        int        span;                       /// blocks after the start block a subsequence reaches
+        Window    *win;                        /// one warping window per R, narrow to wide
+        int        nw;
+        double     bsf;                        /// best-so-far of the window still easiest to beat
+        int        id;                         /// position in the query file of a query set
+        int        group;                      /// cluster of a query set, -1 if none
+    } Query;
+
+/// Linear interpolation of x (n points) to y (m points)
+void resample(double *x, int n, double *y, int m)
+{
+    for (int k = 0; k < m; k++)
     {
-        if (i > r)
-        {
-            u[i-r-1] = t[front(&du)];
-            l[i-r-1] = t[front(&dl)];
+        double p = m > 1 ? (double)k*(n-1)/(m-1) : 0;
+        int a = (int)p;
+        if (a >= n-1)
+            y[k] = x[n-1];
+        else
+            y[k] = x[a] + (p-a)*(x[a+1]-x[a]);
+    }
+}
+
+/// Number of windows in the comma separated list R, at most
+int window_count(const char *R)
+{
+    int n = 1;
+    for (; *R; R++)
+        n += *R == ',';
+    return n;
+}
+
+/// Arena space of one query length with nw windows; nblocks of a block file, else 0
+size_t query_bytes(int m, int nw, long long nblocks)
+{
+    return arena_piece(sizeof(Window)*nw) + 2*arena_piece(sizeof(double)*m) +
+           (nblocks > 0 ? 2*arena_piece(sizeof(double)*nblocks) : 0) + nw*window_bytes(m);
+}
+
+/// Set up the query of length m from the raw query rq, rqA of n points, resampled if n != m,
+/// with one window per R of the comma separated list R. bsum are the block summaries of
+/// a block file h, NULL for text. The query order is exact for run 1, else in runs.
+void query_init(Arena *A, Query *Q, int m, double *rq, double *rqA, int n, const char *R, int w,
+                BlockHeader *h, BlockSummary *bsum, int run)
+{
+    double ex = 0, ex2 = 0, exA = 0, ex2A = 0, mean, std, meanA, stdA;
+    int *order, *orderA;
+    int i;
+
+    memset(Q, 0, sizeof(Query));
+    Q->m = m;
+    Q->win = (Window *)arena_alloc(A, sizeof(Window)*window_count(R));
+    Q->q = (double *)arena_alloc(A, sizeof(double)*m);
+    Q->qA = (double *)arena_alloc(A, sizeof(double)*m);
+    order = (int *)malloc(sizeof(int)*m);
+    orderA = (int *)malloc(sizeof(int)*m);
+    if( order == NULL || orderA == NULL )
+        error(1);
+
+    resample(rq, n, Q->q, m);
+    resample(rqA, n, Q->qA, m);
+    for (i = 0; i < m; i++)
+    {   ex += Q->q[i];
+        ex2 += Q->q[i]*Q->q[i];
+        exA += Q->qA[i];
+        ex2A += Q->qA[i]*Q->qA[i];
+    }
+
+    /// Do z-normalize the query, keep in same array, q
+    mean = ex/m;
+    std = ex2/m;
+    std = sqrt(std-mean*mean);
+
+    meanA = exA/m;
+    stdA = ex2A/m;
+    stdA = sqrt(stdA-meanA*meanA);
+    for (i = 0; i < m; i++)
+    {   Q->q[i] = (Q->q[i] - mean)/std;
+        Q->qA[i] = (Q->qA[i] - meanA)/stdA;
+    }
+
+    /// Sort the query one time by abs(z-norm(q[i]))
+    query_order(Q->q, m, order, run);
+    query_order(Q->qA, m, orderA, run);
+
+    /// One window per R of the list
+    {
+        char *list = strdup(R), *tok;
+        if( list == NULL )
+            error(1);
+        for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ","))
+        {   double v = atof(tok);
+            window_init(A, &Q->win[Q->nw], v, window_r(v, m), w, Q->q, Q->qA, order, orderA, m);
+            Q->win[Q->nw].id = Q->nw;
+            Q->nw++;
         }
-        if (t[i] > t[i-1])
-        {
-            pop_back(&du);
-            while (!empty(&du) && t[i] > t[back(&du)])
-                pop_back(&du);
+        free(list);
+        free(order);
+        free(orderA);
+        if (Q->nw == 0)
+            error(4);
+        qsort(Q->win, Q->nw, sizeof(Window), comp_window);
+    }
+    Q->bsf = INF;
+
+    /// Block level lower bounds for every start block of a block file
+    if (bsum != NULL)
+    {
+        double *qs = (double *)malloc(sizeof(double)*m);
+        double *qsA = (double *)malloc(sizeof(double)*m);
+        Q->glb = (double *)arena_alloc(A, sizeof(double)*h->nblocks);
+        Q->glbA = (double *)arena_alloc(A, sizeof(double)*h->nblocks);
+        if( qs == NULL || qsA == NULL )
+            error(1);
+        for (i = 0; i < m; i++)
+        {   qs[i] = Q->q[i];
+            qsA[i] = Q->qA[i];
+        }
+        qsort(qs, m, sizeof(double), comp_value);
+        qsort(qsA, m, sizeof(double), comp_value);
+        block_bounds(h, bsum, 0, qs, m, Q->glb);
+        block_bounds(h, bsum, 1, qsA, m, Q->glbA);
+        Q->span = (h->block_size+m-2)/h->block_size;
+        free(qs);
+        free(qsA);
+    }
+}
+
+/// The distinct warping windows of the lengths mmin..mmax in steps of mstep for the comma
+/// separated list R, into rs; returns their number. rs has room for one per length and R.
+int envelope_rs(int mmin, int mmax, int mstep, const char *R, int *rs)
+{
+    int n = 0;
+    for (int m = mmin; m <= mmax; m += mstep)
+    {
+        char *list = strdup(R), *tok;
+        if( list == NULL )
+            error(1);
+        for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ","))
+        {   int r = window_r(atof(tok), m), k = 0;
+            while (k < n && rs[k] != r)
+                k++;
+            if (k == n)
+                rs[n++] = r;
+        }
+        free(list);
+    }
+    return n;
+}
+
+/// Chunk envelopes of size EPOCH for the n warping windows rs, of codes if quant, and every
+/// window of Qs pointed at the one of its r
+Envelope *envelope_init(Arena *A, int *rs, int n, Query *Qs, int nq, int EPOCH, bool quant)
+{
+    Envelope *E = (Envelope *)arena_alloc(A, sizeof(Envelope)*n);
+    memset(E, 0, sizeof(Envelope)*n);
+    for (int k = 0; k < n; k++)
+    {   E[k].r = rs[k];
+        if (quant)
+        {   E[k].cl = (int16_t *)arena_alloc(A, sizeof(int16_t)*EPOCH);
+            E[k].cu = (int16_t *)arena_alloc(A, sizeof(int16_t)*EPOCH);
+            E[k].clA = (int16_t *)arena_alloc(A, sizeof(int16_t)*EPOCH);
+            E[k].cuA = (int16_t *)arena_alloc(A, sizeof(int16_t)*EPOCH);
         }
         else
+        {   E[k].l = (double *)arena_alloc(A, sizeof(double)*EPOCH);
+            E[k].u = (double *)arena_alloc(A, sizeof(double)*EPOCH);
+            E[k].lA = (double *)arena_alloc(A, sizeof(double)*EPOCH);
+            E[k].uA = (double *)arena_alloc(A, sizeof(double)*EPOCH);
+        }
+    }
+    for (int x = 0; x < nq; x++)
+        for (int y = 0; y < Qs[x].nw; y++)
+        {   Window *W = &Qs[x].win[y];
+            int k = 0;
+            while (E[k].r != W->r)
+                k++;
+            W->env = &E[k];
+        }
+    return E;
+}
+
+/// Mean and std of the starts of the chunk x, y up to upto-1, into mu, sd at start modulo KIM_LANES.
+/// The running sums add every point before the start it ends and take the first point away
+/// after it, in the order of the original scan, so the values are the same bit for bit.
+/// x, y may be the codes of a quantized chunk, which gives mean and std in their units.
+template <typename V>
+void query_stats(Query *Q, V *x, V *y, long long upto)
+{
+    int m = Q->m;
+    for (; Q->ahead < upto; Q->ahead++)
+    {
+        long long s = Q->ahead;
+        int k = s % KIM_LANES;
+        for (; Q->added < s+m; Q->added++)
+        {   double d = x[Q->added], dA = y[Q->added];
+            Q->ex += d;
+            Q->ex2 += d*d;
+            Q->exA += dA;
+            Q->ex2A += dA*dA;
+        }
+        Q->mu[k] = Q->ex/m;
+        Q->muA[k] = Q->exA/m;
+        Q->sd[k] = sqrt(Q->ex2/m - Q->mu[k]*Q->mu[k]);
+        Q->sdA[k] = sqrt(Q->ex2A/m - Q->muA[k]*Q->muA[k]);
+        Q->ex -= x[s];
+        Q->ex2 -= x[s]*x[s];
+        Q->exA -= y[s];
+        Q->ex2A -= y[s]*y[s];
+    }
+}
+
+/// A cluster of similar queries of a query set (-set), all of the same length and windows.
+/// The union of their envelopes for the widest window is below and above the envelope of
+/// each of them, so its LB_Keogh bounds the DTW of every query of the cluster for every
+/// window. A start whose bound reaches the best-so-far of all of them is pruned for the
+/// whole cluster at once.
+typedef struct Group
+    {   int        n;
+        int       *member;                     /// index in Qs of the queries
+        SortedPoint *so, *soA;                 /// the union envelope, in the order of the centroid
+        long long  at;                         /// start of the last check, -1 before the first,
+        bool       pruned;                     /// and its outcome
+    } Group;
+
+/// Arena space of ng clusters of nq queries of length m
+size_t group_bytes(int ng, int nq, int m)
+{
+    return arena_piece(sizeof(Group)*ng) + arena_piece(sizeof(int)*nq) + 2*ng*arena_piece(sizeof(SortedPoint)*m);
+}
+
+/// Cluster the nq queries of Qs into at most ng groups: the farthest query from all centers
+/// so far becomes the next center, then every query goes to the nearest center, by the
+/// Euclidean distance of both z-normalized dimensions. Sets Q->group; returns the number of
+/// clusters with more than one query, which are numbered first, the others get -1.
+int cluster_queries(Query *Qs, int nq, int ng)
+{
+    int m = Qs[0].m, *center, *size, *num, c, x, k, n = 0;
+    double *near;
+
+    ng = max(1, min(ng, nq));
+    center = (int *)malloc(sizeof(int)*ng);
+    size = (int *)calloc(ng, sizeof(int));
+    num = (int *)malloc(sizeof(int)*ng);
+    near = (double *)malloc(sizeof(double)*nq);
+    if( center == NULL || size == NULL || num == NULL || near == NULL )
+        error(1);
+    for (x = 0; x < nq; x++)
+        near[x] = INF;
+    center[0] = 0;
+    for (c = 0; c < ng; c++)
+    {
+        if (c > 0)
+        {   center[c] = 0;
+            for (x = 1; x < nq; x++)
+                if (near[x] > near[center[c]])
+                    center[c] = x;
+        }
+        for (x = 0; x < nq; x++)
+        {   double d = 0;
+            for (k = 0; k < m; k++)
+                d += dist(Qs[x].q[k], Qs[center[c]].q[k]) + dist(Qs[x].qA[k], Qs[center[c]].qA[k]);
+            if (d < near[x])
+            {   near[x] = d;
+                Qs[x].group = c;
+            }
+        }
+    }
+    for (x = 0; x < nq; x++)
+        size[Qs[x].group]++;
+    for (c = 0; c < ng; c++)
+        num[c] = size[c] > 1 ? n++ : -1;
+    for (x = 0; x < nq; x++)
+        Qs[x].group = num[Qs[x].group];
+    free(center);
+    free(size);
+    free(num);
+    free(near);
+    return n;
+}
+
+/// Union envelopes of the ng clusters that cluster_queries made of Qs, in the query order
+/// of run (see query_init)
+void group_init(Arena *A, Group *G, int ng, Query *Qs, int nq, int run)
+{
+    int m = Qs[0].m, nw = Qs[0].nw, *member = (int *)arena_alloc(A, sizeof(int)*nq);
+    double *c = (double *)malloc(sizeof(double)*m);
+    double *cA = (double *)malloc(sizeof(double)*m);
+    int *order = (int *)malloc(sizeof(int)*m);
+    int *orderA = (int *)malloc(sizeof(int)*m);
+    if( c == NULL || cA == NULL || order == NULL || orderA == NULL )
+        error(1);
+    for (int g = 0; g < ng; g++)
+    {
+        memset(&G[g], 0, sizeof(Group));
+        G[g].member = member;
+        for (int x = 0; x < nq; x++)
+            if (Qs[x].group == g)
+                G[g].member[G[g].n++] = x;
+        member += G[g].n;
+        G[g].so = (SortedPoint *)arena_alloc(A, sizeof(SortedPoint)*m);
+        G[g].soA = (SortedPoint *)arena_alloc(A, sizeof(SortedPoint)*m);
+        G[g].at = -1;
+
+        /// Centroid for the order, union of the envelopes of the widest window
+        for (int i = 0; i < m; i++)
+        {   c[i] = cA[i] = 0;
+            G[g].so[i].uo = G[g].soA[i].uo = -INF;
+            G[g].so[i].lo = G[g].soA[i].lo = INF;
+        }
+        for (int k = 0; k < G[g].n; k++)
+        {   Query *Q = &Qs[G[g].member[k]];
+            Window *W = &Q->win[nw-1];
+            for (int i = 0; i < m; i++)
+            {   c[i] += Q->q[i]/G[g].n;
+                cA[i] += Q->qA[i]/G[g].n;
+                G[g].so[i].uo = max(G[g].so[i].uo, W->u[i]);
+                G[g].so[i].lo = min(G[g].so[i].lo, W->l[i]);
+                G[g].soA[i].uo = max(G[g].soA[i].uo, W->uA[i]);
+                G[g].soA[i].lo = min(G[g].soA[i].lo, W->lA[i]);
+            }
+        }
+
+        /// The union is still indexed by position; sort it as the centroid
+        SortedPoint *u = (SortedPoint *)malloc(sizeof(SortedPoint)*m);
+        SortedPoint *uA = (SortedPoint *)malloc(sizeof(SortedPoint)*m);
+        if( u == NULL || uA == NULL )
+            error(1);
+        memcpy(u, G[g].so, sizeof(SortedPoint)*m);
+        memcpy(uA, G[g].soA, sizeof(SortedPoint)*m);
+        query_order(c, m, order, run);
+        query_order(cA, m, orderA, run);
+        for (int i = 0; i < m; i++)
+        {   G[g].so[i].order = order[i];
+            G[g].so[i].qo = c[order[i]];
+            G[g].so[i].uo = u[order[i]].uo;
+            G[g].so[i].lo = u[order[i]].lo;
+            G[g].soA[i].order = orderA[i];
+            G[g].soA[i].qo = cA[orderA[i]];
+            G[g].soA[i].uo = uA[orderA[i]].uo;
+            G[g].soA[i].lo = uA[orderA[i]].lo;
+        }
+        free(u);
+        free(uA);
+    }
+    free(c);
+    free(cA);
+    free(order);
+    free(orderA);
+}
+
+/// Move the source past the blocks which no surviving subsequence needs.
+/// Block b is needed as long as, for one of the query lengths, one of the start blocks
+/// b-span..b can still beat best-so-far.
+/// Only acts at block boundaries of a block file; returns the number of blocks skipped.
+long long skip_blocks(Source *s, Query *Qs, int nq)
+{
+    long long b, k, skipped = 0;
+    int x;
+
+    if (!s->blocked || s->pos < s->len)
+        return 0;
+    for (b = s->b; b < s->hdr.nblocks; b++, skipped++)
+    {
+        for (x = 0; x < nq; x++)
         {
-            pop_back(&dl);
-            while (!empty(&dl) && t[i] < t[back(&dl)])
-                pop_back(&dl);
-        }
-        push_back(&du, i);
-        push_back(&dl, i);
-        if (i == 2 * r + 1 + front(&du))
-            pop_front(&du);
-        else if (i == 2 * r + 1 + front(&dl))
-            pop_front(&dl);
-    }
-    for (int i = len; i < len+r+1; i++)
-    {
-        u[i-r-1] = t[front(&du)];
-        l[i-r-1] = t[front(&dl)];
-        if (i-front(&du) >= 2 * r + 1)
-            pop_front(&du);
-        if (i-front(&dl) >= 2 * r + 1)
-            pop_front(&dl);
-    }
-    destroy(&du);
-    destroy(&dl);
-}
-
-/// Calculate quick lower bound
-/// Usually, LB_Kim take time O(m) for finding top,bottom,fist and last.
-/// However, because of z-normalization the top and bottom cannot give siginifant benefits.
-/// And using the first and last points can be computed in constant time.
-/// The prunning power of LB_Kim is non-trivial, especially when the query is not long, say in length 128.
-double lb_kim_hierarchy(double *t, double *q, int j, int len, double mean, double std, double bsf = INF)
-{
-    /// 1 point at front and back
-    double d, lb;
-    double x0 = (t[j] - mean) / std;
-    double y0 = (t[(len-1+j)] - mean) / std;
-    lb = dist(x0,q[0]) + dist(y0,q[len-1]);
-    if (lb >= bsf)   return lb;
-
-    /// 2 points at front
-    double x1 = (t[(j+1)] - mean) / std;
-    d = min(dist(x1,q[0]), dist(x0,q[1]));
-    d = min(d, dist(x1,q[1]));
-    lb += d;
-    if (lb >= bsf)   return lb;
-
-    /// 2 points at back
-    double y1 = (t[(len-2+j)] - mean) / std;
-    d = min(dist(y1,q[len-1]), dist(y0, q[len-2]) );
-    d = min(d, dist(y1,q[len-2]));
-    lb += d;
-    if (lb >= bsf)   return lb;
-
-    /// 3 points at front
-    double x2 = (t[(j+2)] - mean) / std;
-    d = min(dist(x0,q[2]), dist(x1, q[2]));
-    d = min(d, dist(x2,q[2]));
-    d = min(d, dist(x2,q[1]));
-    d = min(d, dist(x2,q[0]));
-    lb += d;
-    if (lb >= bsf)   return lb;
-
-    /// 3 points at back
-    double y2 = (t[(len-3+j)] - mean) / std;
-    d = min(dist(y0,q[len-3]), dist(y1, q[len-3]));
-    d = min(d, dist(y2,q[len-3]));
-    d = min(d, dist(y2,q[len-2]));
-    d = min(d, dist(y2,q[len-1]));
-    lb += d;
-
-    return lb;
-}
-
-/// LB_Keogh 1: Create Envelop for the query
-/// Note that because the query is known, envelop can be created once at the begenining.
-///
-/// Variable Explanation,
-/// order : sorted indices for the query.
-/// uo, lo: upper and lower envelops for the query, which already sorted.
-/// t     : a circular array keeping the current data.
-/// j     : index of the starting location in t
-/// cb    : (output) current bound at each position. It will be used later for early abandoning in DTW.
-double lb_keogh_cumulative(int* order, double *t, double *uo, double *lo, double *cb, int j, int len, double mean, double std, double best_so_far = INF)
-{
-    double lb = 0;
-    double x, d;
-
-    for (int i = 0; i < len && lb < best_so_far; i++)
-    {
-        x = (t[(order[i]+j)] - mean) / std;
-        d = 0;
-        if (x > uo[i])
-            d = dist(x,uo[i]);
-        else if(x < lo[i])
-            d = dist(x,lo[i]);
-        lb += d;
-        cb[order[i]] = d;
-    }
-    return lb;
-}
-
-/// LB_Keogh 2: Create Envelop for the data
-/// Note that the envelops have been created (in main function) when each data point has been read.
-///
-/// Variable Explanation,
-/// tz: Z-normalized data
-/// qo: sorted query
-/// cb: (output) current bound at each position. Used later for early abandoning in DTW.
-/// l,u: lower and upper envelop of the current data
-double lb_keogh_data_cumulative(int* order, double *tz, double *qo, double *cb, double *l, double *u, int len, double mean, double std, double best_so_far = INF)
-{
-    double lb = 0;
-    double uu,ll,d;
-
-    for (int i = 0; i < len && lb < best_so_far; i++)
-    {
-        uu = (u[order[i]]-mean)/std;
-        ll = (l[order[i]]-mean)/std;
-        d = 0;
-        if (qo[i] > uu)
-            d = dist(qo[i], uu);
-        else
-        {   if(qo[i] < ll)
-            d = dist(qo[i], ll);
+            Query *Q = &Qs[x];
+            for (k = max(0, b-Q->span); k <= b; k++)
+                if (Q->glb[k] + Q->glbA[k] < Q->bsf)
+                    break;
+            if (k <= b)
+                break;
         }
-        lb += d;
-        cb[order[i]] = d;
+        if (x < nq)
+            break;
     }
-    return lb;
+    s->b = b;
+    s->next = min(b*s->hdr.block_size, s->hdr.n);
+    return skipped;
 }
 
-/// Calculate Dynamic Time Wrapping distance
-/// A,B: data and query, respectively
-/// cb : cummulative bound used for early abandoning
-/// r  : size of Sakoe-Chiba warpping band
-double dtw(double* A, double* B, double *cb, int m, int r, double bsf = INF)
+/// Seconds of wall clock time since the first call, for the time budget
+double wall_time()
 {
+    static std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
 
-    double *cost;
-    double *cost_prev;
-    double *cost_tmp;
-    int i,j,k;
-    double x,y,z,min_cost;
+/// DTW of both dimensions of one raw subsequence, z-normalized here, for the seed candidates.
+/// tz is a work array and cb an all-zero bound, both of size m.
+/// Returns INF if the subsequence cannot beat bsf.
+double seed_dtw(double *x, double *y, double *q, double *qA, double *tz, double *cb, int m, int r,
+                double bsf, double *d1, double *d2)
+{
+    double *v[2] = { x, y };
+    double *qq[2] = { q, qA };
+    double d[2] = { 0, 0 };
 
-    /// Instead of using matrix of size O(m^2) or O(mr), we will reuse two array of size O(r).
-    cost = (double*)malloc(sizeof(double)*(2*r+1));
-    for(k=0; k<2*r+1; k++)    cost[k]=INF;
+    for (int k = 0; k < 2; k++)
+    {
+        double ex = 0, ex2 = 0, mean, std;
+        for (int i = 0; i < m; i++)
+        {   ex += v[k][i];
+            ex2 += v[k][i]*v[k][i];
+        }
+        mean = ex/m;
+        std = ex2/m - mean*mean;
+        if (!(std > 0))
+            return INF;
+        std = sqrt(std);
+        for (int i = 0; i < m; i++)
+            tz[i] = (v[k][i] - mean)/std;
+        d[k] = dtw(tz, qq[k], cb, m, r, k == 0 ? bsf : bsf - d[0]);
+        if (d[0] + (k == 1 ? d[1] : 0) >= bsf)
+            return INF;
+    }
+    *d1 = d[0];
+    *d2 = d[1];
+    return d[0] + d[1];
+}
 
-    cost_prev = (double*)malloc(sizeof(double)*(2*r+1));
-    for(k=0; k<2*r+1; k++)    cost_prev[k]=INF;
+/// Seed candidates spread evenly over a block file: the DTW of ns start positions, each read
+/// once for all nq queries and their windows. A query of length m takes the first m points.
+/// x, y are work arrays of size mmax.
+void seed_sample(Source *s, int ns, Query *Qs, int nq, int mmax, double *x, double *y,
+                 double *tz, double *cb)
+{
+    long long p, cached = -1, starts = s->hdr.n - mmax + 1;
+    double e1, e2, d;
 
-    for (i=0; i<m; i++)
+    for (int k = 0; k < ns && starts > 0; k++)
     {
-        k = max(0,r-i);
-        min_cost = INF;
+        p = ns > 1 ? (long long)((double)k*(starts-1)/(ns-1)) : starts/2;
+        if (!block_read_window(s->fp, &s->hdr, p, mmax, x, y, s->x, s->y, &cached))
+            break;
+        for (int a = 0; a < nq; a++)
+            for (int w = 0; w < Qs[a].nw; w++)
+            {   Window *W = &Qs[a].win[w];
+                d = seed_dtw(x, y, Qs[a].q, Qs[a].qA, tz, cb, Qs[a].m, W->r, W->seed, &e1, &e2);
+                if (d < W->seed)
+                {   W->seed = d;
+                    W->bsfd = e1;
+                    W->bsfdA = e2;
+                    W->seedloc = p;
+                }
+            }
+    }
+}
+
+/// Seed candidates from one quick pass of z-normalized Euclidean distance over all data, for
+/// all nq queries at once, with early abandoning in the sorted query order as in UCR_ED.
+/// Queries of the same length, as in a query set, share the running sums, mean and std.
+/// The window of the best match of query a is copied to bx, by + a*mmax and its location to
+/// loc[a], -1 if none.
+void seed_ed(Source *s, Query *Qs, int nq, int mmax, double *bx, double *by, long long *loc)
+{
+    double *T, *TA, *bsf;
+    double d, dA, ex = 0, ex2 = 0, exA = 0, ex2A = 0, mean = 0, std = 0, meanA = 0, stdA = 0, sum;
+    double (*S)[4];
+    long long i = 0;
+    int j = 0, k, m, M = mmax, ok = 0;
+
+    T = (double *)malloc(sizeof(double)*2*M);
+    TA = (double *)malloc(sizeof(double)*2*M);
+    S = (double (*)[4])calloc(nq, sizeof(double[4]));
+    bsf = (double *)malloc(sizeof(double)*nq);
+    if (T == NULL || TA == NULL || S == NULL || bsf == NULL)
+        error(1);
+    for (int a = 0; a < nq; a++)
+    {   bsf[a] = INF;
+        loc[a] = -1;
+    }
 
-        for(j=max(0,i-r); j<=min(m-1,i+r); j++, k++)
+    while (next_point(s, &d, &dA))
+    {
+        T[i%M] = T[(i%M)+M] = d;
+        TA[i%M] = TA[(i%M)+M] = dA;
+        for (int a = 0, g = 0; a < nq; a++)
         {
-            /// Initialize all row and column
-            if ((i==0)&&(j==0))
+            SortedPoint *so = Qs[a].win[0].so, *soA = Qs[a].win[0].soA;
+            m = Qs[a].m;
+            /// The sums of the first query of each length, in S[g]
+            if (a == 0 || m != Qs[a-1].m)
             {
-                cost[k]=dist(A[0],B[0]);
-                min_cost = cost[k];
+                g = a;
+                ex = S[g][0] += d;
+                ex2 = S[g][1] += d*d;
+                exA = S[g][2] += dA;
+                ex2A = S[g][3] += dA*dA;
+                if (i < m-1)
+                    continue;
+                j = (i-m+1)%M;
+                mean = ex/m;
+                std = ex2/m - mean*mean;
+                meanA = exA/m;
+                stdA = ex2A/m - meanA*meanA;
+                ok = std > 0 && stdA > 0;
+                if (ok)
+                {   std = sqrt(std);
+                    stdA = sqrt(stdA);
+                }
+            }
+            else if (i < m-1)
                 continue;
+            if (ok)
+            {
+                sum = 0;
+                for (k = 0; k < m && sum < bsf[a]; k++)
+                {   double z = (T[so[k].order+j] - mean)/std;
+                    sum += dist(z, so[k].qo);
+                }
+                for (k = 0; k < m && sum < bsf[a]; k++)
+                {   double z = (TA[soA[k].order+j] - meanA)/stdA;
+                    sum += dist(z, soA[k].qo);
+                }
+                if (sum < bsf[a])
+                {
+                    bsf[a] = sum;
+                    loc[a] = i-m+1;
+                    for (k = 0; k < m; k++)
+                    {   bx[a*mmax+k] = T[k+j];
+                        by[a*mmax+k] = TA[k+j];
+                    }
+                }
+            }
+            /// After the last query of this length, the first point leaves the window
+            if (a == nq-1 || Qs[a+1].m != m)
+            {   S[g][0] -= T[j];
+                S[g][1] -= T[j]*T[j];
+                S[g][2] -= TA[j];
+                S[g][3] -= TA[j]*TA[j];
             }
+        }
+        i++;
+    }
+    free(T);
+    free(TA);
+    free(S);
+    free(bsf);
+}
 
-            if ((j-1<0)||(k-1<0))
-              y = INF;
-            else
-              y = cost[k-1];
-            if ((i-1<0)||(k+1>2*r))
-              x = INF;
-            else
-              x = cost_prev[k+1];
-            if ((i-1<0)||(j-1<0))
-              z = INF;
-            else
-              z = cost_prev[k];
+/// Order of the query learned from the data (-sort learn N). LB_Keogh and LB_Keogh2 abandon
+/// as soon as their sum reaches best-so-far, so the positions that add the most on average
+/// should come first. By default the query is in the order of its magnitude, which only
+/// guesses that: a point far from the mean is more often far from the data as well.
 
-            /// Classic DTW calculation
-            cost[k] = min( min( x, y) , z) + dist(A[i],B[j]);
+/// Sample candidates for order_learn, z-normalized, m points of every one after another in
+/// smp, smpA: ns starts spread evenly over a block file, as for -seed N, or the first ns
+/// windows of m points side by side of a text file. x, y are work arrays of size m.
+/// Constant windows are left out; returns the number of samples.
+int order_sample(Source *s, int ns, int m, double *smp, double *smpA, double *x, double *y)
+{
+    long long p, cached = -1, starts = s->blocked ? s->hdr.n - m + 1 : LLONG_MAX;
+    int n = 0;
 
-            /// Find minimum cost in row for early abandoning (possibly to use column instead of row).
-            if (cost[k] < min_cost)
-            {   min_cost = cost[k];
+    for (int k = 0; k < ns && starts > 0; k++)
+    {
+        bool ok = true;
+        if (s->blocked)
+        {   p = ns > 1 ? (long long)((double)k*(starts-1)/(ns-1)) : starts/2;
+            ok = block_read_window(s->fp, &s->hdr, p, m, x, y, s->x, s->y, &cached);
+        }
+        else
+            for (int i = 0; i < m && ok; i++)
+                ok = next_point(s, &x[i], &y[i]);
+        if (!ok)
+            break;
+        double *v[2] = { x, y }, *z[2] = { smp+(long long)n*m, smpA+(long long)n*m };
+        for (int d = 0; d < 2; d++)
+        {   double ex = 0, ex2 = 0, mean, std;
+            for (int i = 0; i < m; i++)
+            {   ex += v[d][i];
+                ex2 += v[d][i]*v[d][i];
             }
+            mean = ex/m;
+            std = ex2/m - mean*mean;
+            ok = ok && std > 0;
+            std = sqrt(std);
+            for (int i = 0; i < m; i++)
+                z[d][i] = (v[d][i] - mean)/std;
         }
+        n += ok;
+    }
+    source_rewind(s);
+    return n;
+}
 
-        /// We can abandon early if the current cummulative distace with lower bound together are larger than bsf
-        if (i+r < m-1 && min_cost + cb[i+r+1] >= bsf)
-        {   free(cost);
-            free(cost_prev);
-            return min_cost + cb[i+r+1];
+/// Rank the positions of window W by their share of each lower bound, summed over the ns
+/// samples: how far a sample is outside the envelope of the query there for LB_Keogh, and
+/// the query outside the envelope of the sample for LB_Keogh2. Largest first, point by
+/// point. Sorts the records of W for both bounds.
+void order_learn(Window *W, double *q, double *qA, int m, double *smp, double *smpA, int ns)
+{
+    double *share = (double *)malloc(sizeof(double)*m);
+    double *l = (double *)malloc(sizeof(double)*m);
+    double *u = (double *)malloc(sizeof(double)*m);
+    int *order = (int *)malloc(sizeof(int)*m);
+    if( share == NULL || l == NULL || u == NULL || order == NULL )
+        error(1);
+
+    for (int b = 0; b < 4; b++)
+    {
+        int d = b%2;                           /// dimension, and
+        bool data = b >= 2;                    /// LB_Keogh2
+        double *qq = d ? qA : q, *ql = d ? W->lA : W->l, *qu = d ? W->uA : W->u;
+        SortedPoint *so = d ? (data ? W->soA2 : W->soA) : (data ? W->so2 : W->so);
+        for (int i = 0; i < m; i++)
+            share[i] = 0;
+        for (int k = 0; k < ns; k++)
+        {
+            double *t = (d ? smpA : smp) + (long long)k*m;
+            if (data)
+            {   lower_upper_lemire(t, m, W->r, l, u);
+                for (int i = 0; i < m; i++)
+                    if (qq[i] > u[i])
+                        share[i] += dist(qq[i], u[i]);
+                    else if (qq[i] < l[i])
+                        share[i] += dist(qq[i], l[i]);
+            }
+            else
+                for (int i = 0; i < m; i++)
+                    if (t[i] > qu[i])
+                        share[i] += dist(t[i], qu[i]);
+                    else if (t[i] < ql[i])
+                        share[i] += dist(t[i], ql[i]);
         }
+        order_runs(share, m, order, 1);
+        sort_records(so, qq, ql, qu, order, m);
+    }
+    free(share);
+    free(l);
+    free(u);
+    free(order);
+}
 
-        /// Move current array to previous array.
-        cost_tmp = cost;
-        cost = cost_prev;
-        cost_prev = cost_tmp;
+/// The learned orders are kept with the query, in name: a first line "data N file" with the
+/// number of samples and the data file they came from, then a line "id m r" for every query
+/// and window (id is the position in a query set, else 0), and one line with the positions
+/// for each of LB_Keogh and LB_Keogh2 of each dimension. Load them into the windows of Qs;
+/// returns 0 unless they were learned with ns samples of data and all of them are there.
+int order_load(const char *name, const char *data, int ns, Query *Qs, int nq)
+{
+    FILE *f = fopen(name, "r");
+    char line[4096];
+    int id, m, r, n, ok = 1, found = 0, nwin = 0;
+    if( f == NULL )
+        return 0;
+    if (fscanf(f, "data %d ", &n) != 1 || n != ns || fgets(line, sizeof(line), f) == NULL ||
+        (line[strcspn(line, "\n")] = 0, strcmp(line, data) != 0))
+    {   fclose(f);
+        return 0;
     }
-    k--;
+    for (int x = 0; x < nq; x++)
+        nwin += Qs[x].nw;
+    while (ok && fscanf(f, "%d %d %d", &id, &m, &r) == 3)
+    {
+        int *order = (int *)malloc(sizeof(int)*4*m);
+        bool *seen = (bool *)calloc(4*m, sizeof(bool));
+        if( order == NULL || seen == NULL )
+            error(1);
+        for (int i = 0; ok && i < 4*m; i++)
+        {   ok = fscanf(f, "%d", &order[i]) == 1 && order[i] >= 0 && order[i] < m && !seen[(i/m)*m+order[i]];
+            if (ok)
+                seen[(i/m)*m+order[i]] = true;
+        }
+        for (int x = 0; ok && x < nq; x++)
+            for (int k = 0; k < Qs[x].nw; k++)
+            {   Window *W = &Qs[x].win[k];
+                if (Qs[x].id == id && Qs[x].m == m && W->r == r)
+                {   sort_records(W->so, Qs[x].q, W->l, W->u, order, m);
+                    sort_records(W->soA, Qs[x].qA, W->lA, W->uA, order+m, m);
+                    sort_records(W->so2, Qs[x].q, W->l, W->u, order+2*m, m);
+                    sort_records(W->soA2, Qs[x].qA, W->lA, W->uA, order+3*m, m);
+                    found++;
+                }
+            }
+        free(order);
+        free(seen);
+    }
+    fclose(f);
+    return ok && found >= nwin;
+}
+
+/// Write the orders of all windows of Qs, learned with ns samples of data, to name, through
+/// a temporary file
+void order_save(const char *name, const char *data, int ns, Query *Qs, int nq)
+{
+    char tmp[4096];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name, (int)getpid());
+    f = fopen(tmp, "w");
+    if( f == NULL )
+        error(3);
+    fprintf(f, "data %d %s\n", ns, data);
+    for (int x = 0; x < nq; x++)
+        for (int k = 0; k < Qs[x].nw; k++)
+        {   Window *W = &Qs[x].win[k];
+            SortedPoint *so[4] = { W->so, W->soA, W->so2, W->soA2 };
+            fprintf(f, "%d %d %d\n", Qs[x].id, Qs[x].m, W->r);
+            for (int b = 0; b < 4; b++)
+                for (int i = 0; i < Qs[x].m; i++)
+                    fprintf(f, "%d%c", so[b][i].order, i+1 < Qs[x].m ? ' ' : '\n');
+        }
+    if (fclose(f) != 0 || rename(tmp, name) != 0)
+        error(3);
+}
 
-    /// the DTW distance is in the last cell in the matrix of size O(m^2) or at the middle of our array.
-    double final_dtw = cost_prev[k];
-    free(cost);
-    free(cost_prev);
-    return final_dtw;
+/// State of the scan between two chunks, for -checkpoint and -resume.
+/// In the file it is followed by the best-so-far and the counters of every window, and by the
+/// last mmax-1 points of the chunk, which the next chunk starts with.
+#define CHECKPOINT_MAGIC "UCRCKPT3"
+typedef struct Checkpoint
+    {   char       magic[8];
+        char       key[1024];          /// data, query, m, R and the options that change the scan
+        long long  next, offset;       /// next point, and for text its byte offset in the file
+        long long  b, end;             /// block file: next block, and no points from end on
+        int        len, pos;           /// block file: size of the current block and the next point in it
+        long long  base, skipped;
+        long long  seg, segp, segdone, send;
+        int        it, gap;
+        int        nq, tail;           /// query lengths, and points carried over to the next chunk
+        double     seedt, cpu;         /// seconds spent seeding, and on the whole search so far
+    } Checkpoint;
+
+/// Write or read n bytes at p, as save says; returns 0 on failure
+static int checkpoint_io(FILE *f, void *p, size_t n, int save)
+{
+    return save ? fwrite(p, n, 1, f) == 1 : fread(p, n, 1, f) == 1;
+}
+
+/// Everything after the Checkpoint record: the state of every window, then the carried over
+/// points. tail holds the two arrays of the chunk (values of both dimensions), each at the
+/// position the next chunk copies them from.
+int checkpoint_state(FILE *f, Checkpoint *c, Query *Qs, int nq, double **tail, int save)
+{
+    int ok = 1;
+    for (int x = 0; x < nq; x++)
+        for (int k = 0; k < Qs[x].nw; k++)
+        {   Window *W = &Qs[x].win[k];
+            ok = ok && checkpoint_io(f, &W->bsf, sizeof(double), save)
+                    && checkpoint_io(f, &W->bsfd, sizeof(double), save)
+                    && checkpoint_io(f, &W->bsfdA, sizeof(double), save)
+                    && checkpoint_io(f, &W->loc, sizeof(long long), save)
+                    && checkpoint_io(f, &W->seed, sizeof(double), save)
+                    && checkpoint_io(f, &W->seedbsf, sizeof(double), save)
+                    && checkpoint_io(f, &W->seedloc, sizeof(long long), save)
+                    && checkpoint_io(f, &W->shown, sizeof(double), save)
+                    && checkpoint_io(f, &W->kim, sizeof(long long), save)
+                    && checkpoint_io(f, &W->paa, sizeof(long long), save)
+                    && checkpoint_io(f, &W->keogh, sizeof(long long), save)
+                    && checkpoint_io(f, &W->keogh2, sizeof(long long), save)
+                    && checkpoint_io(f, &W->wider, sizeof(long long), save)
+                    && checkpoint_io(f, &W->dtwc, sizeof(long long), save)
+                    && checkpoint_io(f, &W->grp, sizeof(long long), save);
+        }
+    for (int a = 0; a < 2 && c->tail > 0; a++)
+        ok = ok && checkpoint_io(f, tail[a], sizeof(double)*c->tail, save);
+    return ok;
+}
+
+/// Save the state under name. It is written to name.tmp first and then renamed, so a crash
+/// leaves either the previous checkpoint or the new one, never a part of it.
+void checkpoint_write(const char *name, Checkpoint *c, Query *Qs, int nq, double **tail)
+{
+    char tmp[4096];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    f = fopen(tmp, "wb");
+    if( f == NULL )
+        error(3);
+    memcpy(c->magic, CHECKPOINT_MAGIC, 8);
+    if (!checkpoint_io(f, c, sizeof(Checkpoint), 1) || !checkpoint_state(f, c, Qs, nq, tail, 1) ||
+        fflush(f) != 0 || fsync(fileno(f)) != 0)
+        error(3);
+    fclose(f);
+    if (rename(tmp, name) != 0)
+        error(3);
+}
+
+/// Load the checkpoint name into c and the windows of Qs; key must match the one it was saved with
+void checkpoint_read(const char *name, Checkpoint *c, const char *key, Query *Qs, int nq, double **tail)
+{
+    FILE *f = fopen(name, "rb");
+    if( f == NULL )
+        error(2);
+    if (!checkpoint_io(f, c, sizeof(Checkpoint), 0) || memcmp(c->magic, CHECKPOINT_MAGIC, 8) != 0 ||
+        strcmp(c->key, key) != 0 || c->nq != nq)
+        error(7);
+    if (!checkpoint_state(f, c, Qs, nq, tail, 0))
+        error(7);
+    fclose(f);
+}
+
+/// Sharded search (-shards): the data files are cut into ranges of starts, and every range is
+/// searched by a worker process of its own. The workers share the best-so-far of every window
+/// through a shared memory segment, so a match found in one range prunes all others as well,
+/// and leave their results there for the coordinator to merge.
+typedef struct Shard
+    {   int        file;               /// index in the list of data files
+        long long  from, to;           /// starts from..to-1, read up to point to+mmax-1
+        long long  offset;             /// byte offset of point from in a text file
+        long long  skipped;            /// blocks skipped by the worker
+        double     seedt;
+    } Shard;
+
+/// What a worker found for one window
+typedef struct ShardWindow
+    {   double     bsf, bsfd, bsfdA, seed;
+        long long  loc, seedloc;       /// -1 if the best match is not in the shard
+        long long  kim, paa, keogh, keogh2, wider, dtwc, blk;
+    } ShardWindow;
+
+/// Lower the shared best-so-far g to v. It is kept as the bits of the double, which for values
+/// >= 0 sort the same way, so a compare and swap loop does it without a lock.
+static inline void share_put(long long *g, double v)
+{
+    long long b, cur = __atomic_load_n(g, __ATOMIC_RELAXED);
+    memcpy(&b, &v, sizeof(b));
+    while (b < cur && !__atomic_compare_exchange_n(g, &cur, b, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline double share_get(long long *g)
+{
+    long long b = __atomic_load_n(g, __ATOMIC_RELAXED);
+    double v;
+    memcpy(&v, &b, sizeof(v));
+    return v;
+}
+
+/// Take up every shared best-so-far that beats the own one of a window. Its match lies in
+/// another shard, so the window has no location of its own any more. As with the seed, it is
+/// taken a hair above, so that a match at the same distance in this shard is still found;
+/// the merge then keeps the one at the first file and location.
+void share_take(long long *g, Query *Qs, int nq, int nw)
+{
+    for (int x = 0; x < nq; x++)
+    {
+        Query *Q = &Qs[x];
+        for (int k = 0; k < Q->nw; k++)
+        {   double v = share_get(&g[x*nw+k])*(1+1e-9);
+            if (v < Q->win[k].bsf)
+            {   Q->win[k].bsf = v;
+                Q->win[k].loc = -1;
+            }
+        }
+        Q->bsf = Q->win[0].bsf;
+        for (int k = 1; k < Q->nw; k++)
+            Q->bsf = max(Q->bsf, Q->win[k].bsf);
+    }
+}
+
+/// Number of points, one per line, of a text file. Also finds the byte offsets off of the
+/// points at[0..nat-1], given in increasing order.
+long long text_points(FILE *f, long long *at, long long *off, int nat)
+{
+    char buf[1<<16];
+    long long n = 0, pos = 0;
+    size_t got;
+    int a = 0, last = '\n';
+
+    rewind(f);
+    while ((got = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        for (size_t k = 0; k < got; k++)
+        {   if (last == '\n')
+            {   while (a < nat && at[a] == n)
+                    off[a++] = pos + k;
+                n++;
+            }
+            last = buf[k];
+        }
+        pos += got;
+    }
+    while (a < nat)
+        off[a++] = pos;
+    return n;
 }
 
 /// Print function for debugging
@@ -373,11 +1502,46 @@ void error(int id)
         printf("ERROR : File not Found!!!\n\n");
     else if ( id == 3 )
         printf("ERROR : Can't create Output File!!!\n\n");
+    else if ( id == 5 )
+        printf("ERROR : Sampled seeding needs a block file, use -seed ed for text!!!\n\n");
+    else if ( id == 6 )
+        printf("ERROR : Only block files can be visited out of order, text is read in file order!!!\n\n");
+    else if ( id == 7 )
+        printf("ERROR : The checkpoint does not belong to this search!!!\n\n");
+    else if ( id == 8 )
+        printf("ERROR : A worker of the sharded search failed!!!\n\n");
+    else if ( id == 9 )
+        printf("ERROR : A query set must have a multiple of m points!!!\n\n");
+    else if ( id == 10 )
+        printf("ERROR : -seed takes a positive number of positions or ed!!!\n\n");
     else if ( id == 4 )
     {
         printf("ERROR : Invalid Number of Arguments!!!\n");
-        printf("Command Usage:  UCR_DTW.exe  data-file  query-file   m   R\n\n");
+        printf("Command Usage:  UCR_DTW.exe  data-file  query-file   m   R  [options]\n\n");
         printf("For example  :  UCR_DTW.exe  data.txt   query.txt   128  0.05\n");
+        printf("m may be a range min:max[:step], e.g. 96:160:32, to search the query resampled to each length\n");
+        printf("R may be a list, e.g. 0.01,0.05,0.1, to search all of these windows in one scan\n");
+        printf("Options      :  -v    print the full report instead of one line of CSV\n");
+        printf("                -w W  segment width of LB_PAA, 0 to disable it (default: chosen from m and R)\n");
+        printf("                -seed N   start with the best DTW of N positions spread over a block file\n");
+        printf("                -seed ed  start with the DTW of the best Euclidean match of a quick pass\n");
+        printf("                -time SEC stop after SEC seconds with the best match so far, 0 for no limit;\n");
+        printf("                          improvements are printed to stderr as they are found\n");
+        printf("                -norm     compare lengths of a range by distance per point\n");
+        printf("                -prof     time and hardware counters (Linux) per stage of the search\n");
+        printf("                -checkpoint FILE SEC  save the state of the scan to FILE every SEC seconds\n");
+        printf("                -resume FILE          go on from the checkpoint in FILE\n");
+        printf("                -shards N  search in N worker processes, each one a range of the data;\n");
+        printf("                           data-file may be a comma separated list of files then;\n");
+        printf("                           not with -time, -order, -checkpoint or -resume\n");
+        printf("                -sort mag      order the query by abs(z-norm(q[i])), the default\n");
+        printf("                -sort runs     the same in runs of 16 consecutive points, for the cache\n");
+        printf("                -sort learn N  order the query by what its points add to LB_Keogh on N samples\n");
+        printf("                          of the data; kept in query-file.order for later runs\n");
+        printf("                -set K    the query file holds several queries of m points, one after another;\n");
+        printf("                          search all of them, K clusters of similar ones share a first bound\n");
+        printf("                -order file|stride|random  order of the chunks of a block file\n");
+        printf("                          (default: stride with -time, file otherwise)\n");
     }
     exit(1);
 }
@@ -387,486 +1551,1327 @@ int main(  int argc , char *argv[] )
 {
     FILE *fp;            /// data file pointer
     FILE *qp;            /// query file pointer
-    double bsf, bsfA;          /// best-so-far
-    double *t, *tA, *q, *qA;       /// data array and query array
-    int *order, *orderA;          ///new order of the query
-    double *u, *l, *qo, *uo, *lo,*tz,*cb, *cb1, *cb2,*u_d, *l_d;
-    double *uA, *lA, *qoA, *uoA, *loA, *tzA, *cbA, *cb1A, *cb2A, *u_dA, *l_dA;
+    double *rq, *rqA;              /// the query as read from the file
+    int nrq = 0;
+    Arena arena;                   /// all state of the search
+    double *tz, *cb, *cb1, *cb2;
+    double *tzA, *cbA, *cb1A, *cb2A;
+    Query *Qs, *Q;                 /// one query per length, short to long, or of a query set
+    int nq = 0;
+    int nset = 0;                  /// queries of a query set, 0 if not one, see -set
+    int nclus = -1;                /// clusters asked for with -set
+    int learn = 0;                 /// samples to learn the order of the query from, see -sort
+    int orun = 1;                  /// run length of the magnitude order, 1 for exact, see -sort
+    char ordername[4096];          /// where the learned order is kept
+    const char *ordernote = NULL;
+    Group *groups = NULL;          /// the clusters of more than one query
+    int ng = 0;
+    Envelope *envs;                /// the chunk envelopes, one per distinct warping window
+    int *envr, nenv;
+    Window *W;
 
 
     double d;
     double dA;
-    long long i , j;
-    double ex , ex2 , mean, std;
-    double exA, ex2A, meanA, stdA;
-    int m=-1, r=-1;
-    long long loc = 0;
+    long long i;
+    double mean, std;
+    double meanA, stdA;
+    int m=-1, mmin=-1, mmax=-1, mstep=1;
+    bool norm = false;             /// compare lengths by distance per point
     double t1,t2;
-    int kim = 0,keogh = 0, keogh2 = 0;
-    double dist=0, lb_kim=0, lb_k=0, lb_k2=0;
-    double distA = 0, lb_kimA = 0, lb_kA = 0, lb_k2A = 0;
-    double *buffer, *u_buff, *l_buff;
-    double *bufferA, *u_buffA, *l_buffA;
-    Index *Q_tmp, *QA_tmp;
+    double lb_kim=0, lb_k=0, lb_k2=0;
+    double lb_kimA = 0, lb_kA = 0, lb_k2A = 0;
+    double *buffer = NULL;
+    double *bufferA = NULL;
+    int16_t *cbuf = NULL, *cbufA = NULL;   /// the chunk of a quantized file, as codes on grid
+    BlockQuant grid;
+    bool qz = false;                /// the scan works on the codes of a quantized file
+    double *p_buff, *p_buffA;       /// prefix sums of the chunk for LB_PAA
+    double lb_p = 0, lb_pA = 0;
+    int w = -1;                     /// PAA segment width, 0 to disable, -1 to choose
+    Source src;                    /// data source, text or block file
+    BlockSummary *bsum = NULL;     /// block summaries of a block file
+    long long base = 0;            /// global index of buffer[0]
+    long long skipped = 0;
+    bool gap = false, fresh = false;
+    bool verbose = false;
+    Prof pf;                       /// stage profile, see -prof
+    int seedn = 0;                 /// seed candidates sampled, -1 for the Euclidean pass
+    double seedt = 0;
+    double budget = -1;            /// time budget in seconds, 0 for none, -1 if not anytime
+    int visit = -1;                /// ORDER_*, -1 to choose
+    long long *segs = NULL;        /// segments of EPOCH-mmax+1 starts in visiting order
+    long long nseg = 0, seg = 0, segp = 0, segdone = 0, nstarts = 0, covered = 0;
+    long long send = LLONG_MAX;    /// first start of the next segment
+    bool expired = false;
+    double *xt, *xtA, *xz, *xzA;   /// a candidate at full precision, raw and z-normalized
+    double *e_buff = NULL, *e_buffA = NULL;   /// squared quantization error of every point of the chunk,
+    double *pe_buff, *pe_buffA;    /// in steps of grid, and their prefix sums
+    bool lossy = false;            /// whether e_buff holds any
+    const char *ckname = NULL;     /// checkpoint file, see -checkpoint
+    const char *resname = NULL;    /// checkpoint to go on from, see -resume
+    double ckevery = 0, ckt = 0;   /// seconds between checkpoints, and time of the last one
+    Checkpoint ck;
+    char ckkey[1024];
+    double *tail[2];               /// the points of a chunk that the next one starts with
+    const char *dataname = argv[1];
+    char *datalist = NULL, **files = NULL;  /// the data files of a sharded search
+    int nfiles = 0;
+    int nproc = 0;                 /// worker processes of a sharded search, see -shards
+    Shard *shards = NULL;          /// in shared memory, as gbsf and sw
+    int nshards = 0, me = -1;      /// shard of a worker, -1 in the coordinator
+    long long *gbsf = NULL;        /// shared best-so-far of every window
+    ShardWindow *sw = NULL;        /// results of the workers, nwin per shard
+    Prof *spf = NULL;              /// profiles of the workers, one per shard
+    int nwmax = 0, nwin = 0;       /// windows per query length, and in all
+    long long npoints = 0, nblocks = 0;   /// in all data files
 
     /// For every EPOCH points, all cummulative values, such as ex (sum), ex2 (sum square), will be restarted for reducing the floating point error.
     int EPOCH = 100000;
 
     /// If not enough input, display an error.
-    if (argc<=3)
+    if (argc<=4)
         error(4);
+    memset(&pf, 0, sizeof(pf));
 
-    /// read size of the query
-    if (argc>3)
-        m = atol(argv[3]);
+    /// read size of the query, or a range min:max[:step] of sizes
+    if (sscanf(argv[3], "%d:%d:%d", &mmin, &mmax, &mstep) < 2)
+        mmin = mmax = atol(argv[3]);
+    if (mmin < 2 || mmax < mmin || mstep < 1)
+        error(4);
 
-    /// read warping windows
-    if (argc>4)
-    {   double R = atof(argv[4]);
-        if (R<=1)
-            r = floor(R*m);
+    /// read options
+    for (int a = 5; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[a], "-w") == 0 && a+1 < argc)
+            w = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-seed") == 0 && a+1 < argc)
+        {
+            char *end;
+            a++;
+            if (strcmp(argv[a], "ed") == 0)
+                seedn = -1;
+            else
+            {   long v = strtol(argv[a], &end, 10);
+                if (end == argv[a] || *end != '\0' || v <= 0 || v > INT_MAX)
+                    error(10);
+                seedn = (int)v;
+            }
+        }
+        else if (strcmp(argv[a], "-time") == 0 && a+1 < argc)
+        {
+            budget = atof(argv[++a]);
+            budget = max(0.0, budget);
+        }
+        else if (strcmp(argv[a], "-order") == 0 && a+1 < argc)
+        {
+            a++;
+            if (strcmp(argv[a], "file") == 0)          visit = ORDER_FILE;
+            else if (strcmp(argv[a], "stride") == 0)   visit = ORDER_STRIDE;
+            else if (strcmp(argv[a], "random") == 0)   visit = ORDER_RANDOM;
+            else error(4);
+        }
+        else if (strcmp(argv[a], "-norm") == 0)
+            norm = true;
+        else if (strcmp(argv[a], "-prof") == 0)
+            prof_open(&pf);
+        else if (strcmp(argv[a], "-checkpoint") == 0 && a+2 < argc)
+        {
+            ckname = argv[++a];
+            ckevery = atof(argv[++a]);
+            ckevery = max(0.0, ckevery);
+        }
+        else if (strcmp(argv[a], "-resume") == 0 && a+1 < argc)
+            resname = argv[++a];
+        else if (strcmp(argv[a], "-sort") == 0 && a+1 < argc)
+        {
+            a++;
+            if (strcmp(argv[a], "mag") == 0)
+                learn = 0, orun = 1;
+            else if (strcmp(argv[a], "runs") == 0)
+                learn = 0, orun = ORDER_RUN;
+            else if (strcmp(argv[a], "learn") == 0 && a+1 < argc)
+            {
+                learn = atoi(argv[++a]);
+                learn = max(1, learn);
+            }
+            else
+                error(4);
+        }
+        else if (strcmp(argv[a], "-set") == 0 && a+1 < argc)
+        {
+            nclus = atoi(argv[++a]);
+            nclus = max(0, nclus);
+        }
+        else if (strcmp(argv[a], "-shards") == 0 && a+1 < argc)
+        {
+            nproc = atoi(argv[++a]);
+            nproc = max(1, nproc);
+        }
         else
-            r = floor(R);
+            error(4);
     }
 
-    fp = fopen(argv[1],"r");
-    if( fp == NULL )
-        error(2);
-
-    qp = fopen(argv[2],"r");
-    if( qp == NULL )
-        error(2);
-
-    /// start the clock
-    t1 = clock();
-
-
-    /// malloc everything here
-    q = (double *)malloc(sizeof(double)*m);
-    if( q == NULL )
-        error(1);
-
-    qA = (double *)malloc(sizeof(double)*m);
-    if( qA == NULL )
-        error(1);
-    
-    qo = (double *)malloc(sizeof(double)*m);
-    if( qo == NULL )
-        error(1);
-    uo = (double *)malloc(sizeof(double)*m);
-    if( uo == NULL )
-        error(1);
-    lo = (double *)malloc(sizeof(double)*m);
-    if( lo == NULL )
-        error(1);
-
-    qoA = (double *)malloc(sizeof(double)*m);
-    if( qo == NULL )
-        error(1);
-    uoA = (double *)malloc(sizeof(double)*m);
-    if( uo == NULL )
-        error(1);
-    loA = (double *)malloc(sizeof(double)*m);
-    if( lo == NULL )
-        error(1);
-
-    order = (int *)malloc(sizeof(int)*m);
-    if( order == NULL )
-        error(1);
-
-    orderA = (int *)malloc(sizeof(int)*m);
-    if( orderA == NULL )
-        error(1);
-
-    Q_tmp = (Index *)malloc(sizeof(Index)*m);
-    if( Q_tmp == NULL )
-        error(1);
-
-    QA_tmp = (Index *)malloc(sizeof(Index)*m);
-    if( QA_tmp == NULL )
-        error(1);
-
-    u = (double *)malloc(sizeof(double)*m);
-    if( u == NULL )
-        error(1);
-    uA = (double *)malloc(sizeof(double)*m);
-    if( uA == NULL )
-        error(1);
-
-    l = (double *)malloc(sizeof(double)*m);
-    if( l == NULL )
-        error(1);
-
-    lA = (double *)malloc(sizeof(double)*m);
-    if( lA == NULL )
-        error(1);
-
-    cb = (double *)malloc(sizeof(double)*m);
-    if( cb == NULL )
-        error(1);
-
-    cb1 = (double *)malloc(sizeof(double)*m);
-    if( cb1 == NULL )
-        error(1);
-
-    cb2 = (double *)malloc(sizeof(double)*m);
-    if( cb2 == NULL )
-        error(1);
+    /// Several data files are searched as shards
+    if (strchr(argv[1], ',') != NULL && nproc == 0)
+        nproc = 1;
+    if (nproc > 0 && (budget >= 0 || visit >= 0 || ckname != NULL || resname != NULL || nclus >= 0))
+        error(4);
+    if (nclus >= 0 && mmin < mmax)
+        error(4);
 
-    cbA = (double *)malloc(sizeof(double)*m);
-    if( cb == NULL )
+    /// Sharded search: cut every data file into ranges of starts, about nproc in all, and
+    /// search each one in a worker process, nproc at a time. A worker goes on below with
+    /// the data file and the range of its shard; the coordinator waits for all of them and
+    /// then merges their results.
+    if (nproc > 0) {
+      wall_time();
+      datalist = strdup(argv[1]);
+      files = (char **)malloc(sizeof(char *)*(strlen(argv[1])+1));
+      if( datalist == NULL || files == NULL )
         error(1);
+      for (char *tok = strtok(datalist, ","); tok != NULL; tok = strtok(NULL, ","))
+        files[nfiles++] = tok;
+      if (nfiles == 0)
+        error(2);
 
-    cb1A = (double *)malloc(sizeof(double)*m);
-    if( cb1 == NULL )
+      long long *fn = (long long *)malloc(sizeof(long long)*nfiles);
+      int *fk = (int *)malloc(sizeof(int)*nfiles);
+      bool *ftext = (bool *)malloc(sizeof(bool)*nfiles);
+      if( fn == NULL || fk == NULL || ftext == NULL )
         error(1);
+      for (int f = 0; f < nfiles; f++) {
+        BlockHeader h;
+        FILE *df = fopen(files[f], "rb");
+        if( df == NULL )
+          error(2);
+        ftext[f] = !block_read_header(df, &h);
+        fn[f] = ftext[f] ? text_points(df, NULL, NULL, 0) : h.n;
+        nblocks += ftext[f] ? 0 : h.nblocks;
+        npoints += fn[f];
+        block_free_header(&h);
+        fclose(df);
+      }
+      for (int f = 0; f < nfiles; f++) {
+        fk[f] = max(1, (int)llround((double)nproc*fn[f]/max(1LL, npoints)));
+        nshards += fk[f];
+      }
 
-    cb2A = (double *)malloc(sizeof(double)*m);
-    if( cb2 == NULL )
-        error(1);
-    
-    u_d = (double *)malloc(sizeof(double)*m);
-    if( u == NULL )
+      nwmax = window_count(argv[4]);
+      nwin = ((mmax-mmin)/mstep+1)*nwmax;
+      size_t size = sizeof(long long)*nwin + sizeof(Shard)*nshards + sizeof(ShardWindow)*nshards*nwin +
+                    sizeof(Prof)*nshards;
+      void *shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+      if( shm == MAP_FAILED )
         error(1);
+      gbsf = (long long *)shm;
+      shards = (Shard *)(gbsf + nwin);
+      sw = (ShardWindow *)(shards + nshards);
+      spf = (Prof *)(sw + nshards*nwin);
+      for (int k = 0; k < nwin; k++) {
+        double v = INF;
+        memcpy(&gbsf[k], &v, sizeof(v));
+      }
 
-    l_d = (double *)malloc(sizeof(double)*m);
-    if( l == NULL )
-        error(1);
+      for (int f = 0, s = 0; f < nfiles; s += fk[f], f++) {
+        for (int k = 0; k < fk[f]; k++) {
+          shards[s+k].file = f;
+          shards[s+k].from = fn[f]*k/fk[f];
+          shards[s+k].to = fn[f]*(k+1)/fk[f];
+        }
+        /// a text worker starts reading at the byte offset of its first point
+        if (ftext[f]) {
+          long long *at = (long long *)malloc(sizeof(long long)*fk[f]);
+          long long *off = (long long *)malloc(sizeof(long long)*fk[f]);
+          FILE *df = fopen(files[f], "rb");
+          if( at == NULL || off == NULL || df == NULL )
+            error(1);
+          for (int k = 0; k < fk[f]; k++)
+            at[k] = shards[s+k].from;
+          text_points(df, at, off, fk[f]);
+          for (int k = 0; k < fk[f]; k++)
+            shards[s+k].offset = off[k];
+          fclose(df);
+          free(at);
+          free(off);
+        }
+      }
+      free(fn);
+      free(fk);
+      free(ftext);
+
+      fflush(stdout);
+      int running = 0, status;
+      bool failed = false;
+      for (int s = 0; s < nshards && me < 0; s++) {
+        if (running == nproc) {
+          wait(&status);
+          running--;
+          failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+          error(8);
+        if (pid == 0) {
+          me = s;
+          /// The counters count the process that opened them, so a worker opens its own
+          if (pf.on) {
+            prof_close(&pf);
+            prof_open(&pf);
+          }
+        } else
+          running++;
+      }
+      for (; me < 0 && running > 0; running--) {
+        wait(&status);
+        failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+      }
+      if (failed)
+        error(8);
+      dataname = files[me < 0 ? 0 : shards[me].file];
+    }
 
-    t = (double *)malloc(sizeof(double)*m*2);
-    if( t == NULL )
-        error(1);
+    fp = fopen(dataname,"rb");
+    if( fp == NULL )
+        error(2);
 
-    tA = (double *)malloc(sizeof(double)*m*2);
-    if( tA == NULL )
-        error(1);
+    /// A block file is recognized by its header, anything else is read as text
+    memset(&src, 0, sizeof(src));
+    src.fp = fp;
+    src.blocked = block_read_header(fp, &src.hdr);
+    src.end = src.blocked ? src.hdr.n : LLONG_MAX;
+    src.xb = -1;
+    qz = src.blocked && src.hdr.version == BLOCK_QUANTIZED;
+    if (qz) {
+      src.nslot = (EPOCH-1)/src.hdr.block_size + 3;
+      for (long long b = 0; b < src.hdr.nblocks; b++)
+        src.words = max(src.words, (int)((src.hdr.dir[b+1] - src.hdr.dir[b])/(long long)sizeof(uint64_t)));
+    }
+    if (!src.blocked)
+        rewind(fp);
+    if (visit < 0)
+        visit = budget >= 0 && src.blocked ? ORDER_STRIDE : ORDER_FILE;
+    if (visit != ORDER_FILE && !src.blocked)
+        error(6);
 
-    tz = (double *)malloc(sizeof(double)*m);
-    if( tz == NULL )
-        error(1);
+    qp = fopen(argv[2],"r");
+    if( qp == NULL )
+        error(2);
 
-    tzA = (double *)malloc(sizeof(double)*m);
-    if( tzA == NULL )
-        error(1);
+    /// start the clock
+    t1 = clock();
+    wall_time();
 
-    buffer = (double *)malloc(sizeof(double)*EPOCH);
-    if( buffer == NULL )
-        error(1);
 
-    u_buff = (double *)malloc(sizeof(double)*EPOCH);
-    if( u_buff == NULL )
-        error(1);
+    /// Read query file
+    /// A single m takes the first m points; a range of m takes the whole file as one
+    /// pattern, which is resampled to every length. A query set takes all of it, m
+    /// points per query.
+    {
+        int cap = mmax;
+        rq = (double *)malloc(sizeof(double)*cap);
+        rqA = (double *)malloc(sizeof(double)*cap);
+        if( rq == NULL || rqA == NULL )
+            error(1);
+        while(fscanf(qp,"%lf %lf",&d,&dA) != EOF && (mmin < mmax || nclus >= 0 || nrq < mmax))
+        {
+            if (nrq == cap)
+            {   cap *= 2;
+                rq = (double *)realloc(rq, sizeof(double)*cap);
+                rqA = (double *)realloc(rqA, sizeof(double)*cap);
+                if( rq == NULL || rqA == NULL )
+                    error(1);
+            }
+            rq[nrq] = d;
+            rqA[nrq] = dA;
+            nrq++;
+        }
+        fclose(qp);
+        if (nrq == 0)
+            error(2);
+        if (nclus >= 0 && nrq % mmax != 0)
+            error(9);
+        nset = nclus >= 0 ? nrq/mmax : 0;
+    }
 
-    l_buff = (double *)malloc(sizeof(double)*EPOCH);
-    if( l_buff == NULL )
-        error(1);
-    
-    bufferA = (double *)malloc(sizeof(double)*EPOCH);
-    if( bufferA == NULL )
-        error(1);
+    /// One arena for everything the search keeps
+    {
+        int nw = window_count(argv[4]), B = src.blocked ? src.hdr.block_size : 0;
+        size_t size = 12*arena_piece(sizeof(double)*mmax) + 2*arena_piece(sizeof(double)*EPOCH) +
+                      4*arena_piece(sizeof(double)*(EPOCH+1)) + 2*arena_piece(sizeof(double)*B);
+        if (qz)
+          size += 2*arena_piece(sizeof(int16_t)*EPOCH) + arena_piece(sizeof(uint64_t)*src.nslot*src.words) +
+                  arena_piece(sizeof(long long)*src.nslot);
+        nq = nset > 0 ? nset : (mmax-mmin)/mstep+1;
+        size += arena_piece(sizeof(Query)*nq);
+        for (m = mmin; m <= mmax; m += mstep)
+            size += query_bytes(m, nw, src.blocked ? src.hdr.nblocks : 0)*(nset > 0 ? nset : 1);
+        envr = (int *)malloc(sizeof(int)*nw*((mmax-mmin)/mstep+1));
+        if( envr == NULL )
+            error(1);
+        nenv = envelope_rs(mmin, mmax, mstep, argv[4], envr);
+        size += envelope_bytes(nenv, EPOCH, qz);
+        if (nset > 0)
+            size += group_bytes(min(nclus, nset), nset, mmax);
+        arena_init(&arena, size);
+        nq = 0;
+    }
+    cb = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    cb1 = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    cb2 = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    cbA = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    cb1A = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    cb2A = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    tz = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    tzA = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    xt = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    xtA = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    xz = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    xzA = (double *)arena_alloc(&arena, sizeof(double)*mmax);
+    if (qz) {
+      cbuf = (int16_t *)arena_alloc(&arena, sizeof(int16_t)*EPOCH);
+      cbufA = (int16_t *)arena_alloc(&arena, sizeof(int16_t)*EPOCH);
+      e_buff = (double *)arena_alloc(&arena, sizeof(double)*EPOCH);
+      e_buffA = (double *)arena_alloc(&arena, sizeof(double)*EPOCH);
+    } else {
+      buffer = (double *)arena_alloc(&arena, sizeof(double)*EPOCH);
+      bufferA = (double *)arena_alloc(&arena, sizeof(double)*EPOCH);
+    }
+    p_buff = (double *)arena_alloc(&arena, sizeof(double)*(EPOCH+1));
+    p_buffA = (double *)arena_alloc(&arena, sizeof(double)*(EPOCH+1));
+    pe_buff = (double *)arena_alloc(&arena, sizeof(double)*(EPOCH+1));
+    pe_buffA = (double *)arena_alloc(&arena, sizeof(double)*(EPOCH+1));
+    Qs = (Query *)arena_alloc(&arena, sizeof(Query)*(nset > 0 ? nset : (mmax-mmin)/mstep+1));
 
-    u_buffA = (double *)malloc(sizeof(double)*EPOCH);
-    if( u_buffA == NULL )
-        error(1);
-    
-    l_buffA = (double *)malloc(sizeof(double)*EPOCH);
-    if( l_buffA == NULL )
-        error(1);
 
 
-    /// Read query file
-    bsfA = bsf = INF;
-    
-    i = 0;
-    j = 0;
-    ex = ex2 = 0;
-    exA = ex2A = 0;
-
-    while(fscanf(qp,"%lf %lf",&d,&dA) != EOF && i < m)
-    {
-        ex += d;
-        ex2 += d*d;
-        
-        exA += dA;
-        ex2A += dA*dA;
-        q[i] = d;
-        qA[i] = dA;
-        i++;
+    /// Block summaries of a block file, for the block level lower bounds
+    if (src.blocked)
+    {
+        int B = src.hdr.block_size;
+        src.x = (double *)arena_alloc(&arena, sizeof(double)*B);
+        src.y = (double *)arena_alloc(&arena, sizeof(double)*B);
+        bsum = (BlockSummary *)malloc(sizeof(BlockSummary)*src.hdr.nblocks);
+        if( bsum == NULL )
+            error(1);
+        if (!block_read_summaries(fp, &src.hdr, bsum))
+            error(2);
+
+        /// The scan of a quantized file keeps the records of the blocks of a chunk, for
+        /// the codes and for the exact values of the candidates which reach DTW
+        if (qz) {
+            src.slot = (uint64_t *)arena_alloc(&arena, sizeof(uint64_t)*src.nslot*src.words);
+            src.slotb = (long long *)arena_alloc(&arena, sizeof(long long)*src.nslot);
+            for (int k = 0; k < src.nslot; k++)
+                src.slotb[k] = -1;
+        }
     }
-    fclose(qp);
-
-    /// Do z-normalize the query, keep in same array, q
-    mean = ex/m;
-    std = ex2/m;
-    std = sqrt(std-mean*mean);
 
-    meanA = exA/m;
-    stdA = ex2A/m;
-    stdA = sqrt(stdA-meanA*meanA);
-    for( i = 0 ; i < m ; i++ ) {
-         q[i] = (q[i] - mean)/std;
-         qA[i] = (qA[i] - meanA)/stdA;
+    /// Envelopes, orders and block bounds of every query length, or of every query of a set
+    if (nset > 0) {
+      for (int a = 0; a < nset; a++) {
+        query_init(&arena, &Qs[nq], mmax, rq+a*mmax, rqA+a*mmax, mmax, argv[4], w, &src.hdr, bsum, orun);
+        Qs[nq].id = a;
+        Qs[nq++].group = -1;
+      }
+      if (nclus > 0) {
+        ng = cluster_queries(Qs, nq, nclus);
+        groups = (Group *)arena_alloc(&arena, sizeof(Group)*max(1, ng));
+        group_init(&arena, groups, ng, Qs, nq, orun);
+      }
+    } else {
+      for (m = mmin; m <= mmax; m += mstep) {
+        query_init(&arena, &Qs[nq], m, rq, rqA, nrq, argv[4], w, &src.hdr, bsum, orun);
+        Qs[nq++].group = -1;
+      }
+    }
+    envs = envelope_init(&arena, envr, nenv, Qs, nq, EPOCH, qz);
+    free(envr);
+    mmax = Qs[nq-1].m;
+
+    /// The order of the query learned from a sample of the data, or as saved with the query
+    if (learn > 0) {
+      snprintf(ordername, sizeof(ordername), "%s.order", argv[2]);
+      if (order_load(ordername, dataname, learn, Qs, nq))
+        ordernote = "loaded from";
+      else {
+        double *smp = (double *)malloc(sizeof(double)*learn*mmax);
+        double *smpA = (double *)malloc(sizeof(double)*learn*mmax);
+        if( smp == NULL || smpA == NULL )
+          error(1);
+        for (int a = 0; a < nq; a++) {
+          int ns = order_sample(&src, learn, Qs[a].m, smp, smpA, xt, xtA);
+          for (int y = 0; ns > 0 && y < Qs[a].nw; y++)
+            order_learn(&Qs[a].win[y], Qs[a].q, Qs[a].qA, Qs[a].m, smp, smpA, ns);
+        }
+        free(smp);
+        free(smpA);
+        order_save(ordername, dataname, learn, Qs, nq);
+        ordernote = "learned and saved to";
+      }
+    }
+    /// A quantized scan takes the grid of every chunk from the summaries
+    if (!qz) {
+      free(bsum);
+      bsum = NULL;
     }
+    free(rq);
+    free(rqA);
+
+    /// A checkpoint only fits the same data, query, lengths, windows and options
+    memset(&ck, 0, sizeof(ck));
+    snprintf(ckkey, sizeof(ckkey), "%s|%s|%s|%s|w=%d|seed=%d|order=%d|set=%d|epoch=%d",
+             argv[1], argv[2], argv[3], argv[4], w, seedn, visit, nclus, EPOCH);
+    strcpy(ck.key, ckkey);
+    ck.nq = nq;
+    /// a quantized scan reads the blocks of those points again instead, see below
+    ck.tail = qz ? 0 : mmax-1;
+    if (!qz) {
+      tail[0] = buffer+EPOCH-mmax+1;
+      tail[1] = bufferA+EPOCH-mmax+1;
+    }
+    if (resname != NULL)
+        checkpoint_read(resname, &ck, ckkey, Qs, nq, tail);
 
-    /// Create envelop of the query: lower envelop, l, and upper envelop, u
-    //    lower_upper_lemire(
-    lower_upper_lemire(q, m, r, l, u);
-    lower_upper_lemire(qA, m, r, lA, uA);
 
-    /// Sort the query one time by abs(z-norm(q[i]))
-    for( i = 0; i<m; i++) {
-      QA_tmp[i].value = qA[i];
-      QA_tmp[i].index = i;
-      Q_tmp[i].value = q[i];
-      Q_tmp[i].index = i;
-    }
-    qsort(Q_tmp, m, sizeof(Index),comp);
-    qsort(QA_tmp, m, sizeof(Index),comp);
-
-    /// also create another arrays for keeping sorted envelop
-    for( i=0; i<m; i++) {
-      int o = Q_tmp[i].index;
-      int oA = QA_tmp[i].index;
-
-      order[i] = o;
-      orderA[i] = oA;
-
-      qo[i] = q[o];
-      qoA[i] = qA[oA];
-      
-      uo[i] = u[o];
-      uoA[i] = uA[oA];
-      
-      lo[i] = l[o];
-      loA[i] = lA[oA];
-    }
-    free(Q_tmp);
-    free(QA_tmp);
-
-    
     /// Initial the cummulative lower bound
-    for( i=0; i<m; i++) {
+    for( i=0; i<mmax; i++) {
       cb[i]=0;
       cbA[i]=0;
-      
+
       cb1[i]=0;
       cb1A[i] = 0;
-        
+
       cb2[i]=0;
       cb2A[i]=0;
     }
 
+    /// Seeding: start the scan with the DTW of a real candidate instead of INF, so the lower
+    /// bounds prune from the first subsequence on. The answer is still exact, as the scan
+    /// only gets a bound that the best match meets anyway. bsf is set a hair above the seed,
+    /// so the scan finds the seed (or an equal one earlier in the file) again by itself.
+    if (seedn != 0 && resname == NULL && (shards == NULL || me >= 0)) {
+      double ts = clock();
+      double *x = (double *)malloc(sizeof(double)*nq*mmax);
+      double *y = (double *)malloc(sizeof(double)*nq*mmax);
+      double *zero = (double *)calloc(mmax, sizeof(double));
+      long long *edloc = (long long *)malloc(sizeof(long long)*nq);
+      if( x == NULL || y == NULL || zero == NULL || edloc == NULL )
+        error(1);
+      if (seedn > 0 && !src.blocked)
+        error(5);
+      if (seedn > 0)
+        seed_sample(&src, seedn, Qs, nq, mmax, x, y, tz, zero);
+      else
+        seed_ed(&src, Qs, nq, mmax, x, y, edloc);
+      for (int a = 0; a < nq; a++) {
+        Q = &Qs[a];
+        for (int k = 0; k < Q->nw; k++) {
+          W = &Q->win[k];
+          if (seedn < 0 && edloc[a] >= 0) {
+            W->seedloc = edloc[a];
+            W->seed = seed_dtw(x+a*mmax, y+a*mmax, Q->q, Q->qA, tz, zero, Q->m, W->r, INF, &W->bsfd, &W->bsfdA);
+          }
+          if (W->seedloc >= 0 && W->seed < INF) {
+            W->bsf = W->seedbsf = W->seed*(1+1e-9);
+            W->loc = W->seedloc;
+          }
+        }
+      }
+      source_rewind(&src);
+      free(x);
+      free(y);
+      free(zero);
+      free(edloc);
+      seedt = (clock()-ts)/CLOCKS_PER_SEC;
+    }
+    for (int a = 0; a < nq; a++) {
+      Q = &Qs[a];
+      for (int k = 0; k < Q->nw; k++)
+        Q->bsf = k == 0 ? Q->win[k].bsf : max(Q->bsf, Q->win[k].bsf);
+    }
+
+    /// Anytime search: the series is cut into segments of one chunk each, EPOCH-mmax+1 starts,
+    /// which are visited in a spread out order. Each segment is read from its first start on,
+    /// as after a gap. The exact answer does not depend on the order, only ties between
+    /// equal distances may go to another location.
+    if (src.blocked)
+      nstarts = max(0, src.hdr.n-mmin+1);
+    if (visit != ORDER_FILE && nstarts > 0) {
+      nseg = (nstarts+EPOCH-mmax)/(EPOCH-mmax+1);
+      segs = segment_order(nseg, visit);
+      segp = segs[seg++]*(EPOCH-mmax+1);
+      send = segp+EPOCH-mmax+1;
+      source_seek(&src, segp, min(segp+EPOCH, src.hdr.n));
+    }
+
     i = 0;          /// current index of the data in current chunk of size EPOCH
-    j = 0;          /// the starting index of the data in the circular array, t
-    ex = ex2 = 0;
-    exA = ex2A = 0;
     bool done = false;
-    int it=0, ep=0, k=0;
+    int it=0, ep=0, k=0, x;
     long long I;    /// the starting index of the data in current chunk of size EPOCH
+
+    /// Go on between the two chunks where the checkpoint was taken
+    if (resname != NULL) {
+      it = ck.it;
+      gap = ck.gap;
+      base = ck.base;
+      skipped = ck.skipped;
+      seg = ck.seg;
+      segp = ck.segp;
+      segdone = ck.segdone;
+      send = ck.send;
+      seedt = ck.seedt;
+      t1 -= ck.cpu*CLOCKS_PER_SEC;
+      src.next = ck.next;
+      if (src.blocked) {
+        src.b = ck.b;
+        src.end = ck.end;
+        src.len = ck.len;
+        src.pos = ck.pos;
+        /// A quantized scan reads the blocks of the points the next chunk starts with, and of
+        /// the current one, into their slots
+        if (qz) {
+          for (long long b = gap ? src.b-1 : (base+EPOCH-mmax+1)/src.hdr.block_size; b < src.b; b++) {
+            int c;
+            source_record(&src, b, &c);
+          }
+        } else if (src.pos < src.len && block_read(fp, &src.hdr, src.b-1, src.x, src.y) != src.len)
+          error(2);
+      } else if (fseeko(fp, ck.offset, SEEK_SET) != 0)
+        error(2);
+    }
+
+    /// A worker searches the starts of its shard, and offers its seeds to the others;
+    /// the coordinator searches nothing itself
+    if (me >= 0) {
+      Shard *S = &shards[me];
+      send = S->to;
+      if (src.blocked)
+        source_seek(&src, S->from, min(S->to+mmax-1, src.hdr.n));
+      else {
+        if (fseeko(fp, S->offset, SEEK_SET) != 0)
+          error(2);
+        src.next = S->from;
+        src.end = S->to+mmax-1;
+      }
+      for (x=0; x<nq; x++)
+        for (k=0; k<Qs[x].nw; k++)
+          share_put(&gbsf[x*nwmax+k], Qs[x].win[k].bsf);
+    } else if (shards != NULL)
+      done = true;
     while(!done) {
-      /// Read first m-1 points
-      ep=0;
-      if (it==0){
-        for(k=0; k<m-1; k++) {
-          if (fscanf(fp,"%lf\t%lf", &d, &dA) != EOF) {
+      prof_start(&pf);
+      /// Read first mmax-1 points
+      /// After skipped blocks the data is not contiguous, so start over as in the first chunk.
+      fresh = it==0 || gap;
+      if (qz) {
+        /// The codes of a quantized file are read the same way, on one grid per chunk.
+        /// The points carried over are copied from their blocks again, as the grid changes.
+        lossy = false;
+        if (fresh) {
+          gap = false;
+          base = src.next;
+          ep = 0;
+        } else {
+          base += EPOCH-mmax+1;
+          chunk_grid(&src, bsum, base, min(base+EPOCH, src.hdr.n), &grid);
+          chunk_codes(&src, base, mmax-1, &grid, cbuf, cbufA, 0, e_buff, e_buffA, &lossy);
+          ep = mmax-1;
+        }
+        while(ep<EPOCH) {
+          long long sk = skip_blocks(&src, Qs, nq);
+          if (sk > 0) {
+            skipped += sk;
+            if (ep < mmax-1) {
+              base = src.next;
+              ep = 0;
+              lossy = false;
+              continue;
+            }
+            gap = true;
+            break;
+          }
+          if (ep == 0)
+            chunk_grid(&src, bsum, base, min(base+EPOCH, src.hdr.n), &grid);
+          int c = source_codes(&src, &grid, cbuf, cbufA, ep, min(EPOCH, ep < mmax-1 ? mmax-1 : EPOCH)-ep,
+                               e_buff, e_buffA, &lossy);
+          if (c == 0)
+            break;
+          ep += c;
+        }
+      } else {
+        if (fresh){
+          gap = false;
+          base = src.next;
+          for(k=0; k<mmax-1; k++) {
+            long long sk = skip_blocks(&src, Qs, nq);
+            if (sk > 0) {
+              skipped += sk;
+              base = src.next;
+              k = -1;
+              continue;
+            }
+            if (!next_point(&src, &d, &dA))
+              break;
             buffer[k] = d;
             bufferA[k] = dA;
           }
+          ep=k;
+        } else {
+          base += EPOCH-mmax+1;
+          for(k=0; k<mmax-1; k++) {
+            buffer[k] = buffer[EPOCH-mmax+1+k];
+            bufferA[k] = bufferA[EPOCH-mmax+1+k];
+          }
+          ep=mmax-1;
         }
-      } else {
-        for(k=0; k<m-1; k++) {
-          buffer[k] = buffer[EPOCH-m+1+k];
-          bufferA[k] = bufferA[EPOCH-m+1+k];
+
+        /// Read buffer of size EPOCH or when all data has been read.
+        /// Stop early at blocks that no subsequence needs.
+        while(ep<EPOCH) {
+          long long sk = skip_blocks(&src, Qs, nq);
+          if (sk > 0) {
+            skipped += sk;
+            gap = true;
+            break;
+          }
+          int c = source_read(&src, buffer+ep, bufferA+ep, EPOCH-ep);
+          if (c == 0)
+            break;
+          ep += c;
         }
       }
 
-      /// Read buffer of size EPOCH or when all data has been read.
-      ep=m-1;
-      while(ep<EPOCH) {
-        if (fscanf(fp,"%lf\t%lf", &d, &dA) == EOF) {
-          break;
+      /// Prefix sums of the quantization errors, if there are any in this chunk
+      if (lossy) {
+        pe_buff[0] = pe_buffA[0] = 0;
+        for(k=0; k<ep; k++) {
+          pe_buff[k+1] = pe_buff[k] + e_buff[k];
+          pe_buffA[k+1] = pe_buffA[k] + e_buffA[k];
         }
-        buffer[ep] = d;
-        bufferA[ep] = dA;
-        ep++;
       }
-      
+      prof_stop(&pf, PROF_IO);
+
       /// Data are read in chunk of size EPOCH.
       /// When there is nothing to read, the loop is end.
-      if (ep<=m-1) {
-        done = true;
+      if (ep<=mmin-1) {
+        if (!gap)
+          done = true;
       } else {
-        lower_upper_lemire(buffer, ep, r, l_buff, u_buff);
-        lower_upper_lemire(bufferA, ep, r, l_buffA, u_buffA);
+        prof_start(&pf);
+        for (k=0; k<nenv; k++) {
+          if (qz) {
+            lower_upper_lemire(cbuf, ep, envs[k].r, envs[k].cl, envs[k].cu);
+            lower_upper_lemire(cbufA, ep, envs[k].r, envs[k].clA, envs[k].cuA);
+          } else {
+            lower_upper_lemire(buffer, ep, envs[k].r, envs[k].l, envs[k].u);
+            lower_upper_lemire(bufferA, ep, envs[k].r, envs[k].lA, envs[k].uA);
+          }
+        }
+        for (x=0; x<nq; x++) {
+          Q = &Qs[x];
+          Q->ex = Q->ex2 = Q->exA = Q->ex2A = 0;
+          Q->ahead = Q->added = 0;
+          Q->kimgroup = -1;
+        }
+
+        /// Prefix sums for the segment means of LB_PAA
+        if (w != 0) {
+          p_buff[0] = p_buffA[0] = 0;
+          for(k=0; k<ep; k++) {
+            p_buff[k+1] = p_buff[k] + (qz ? cbuf[k] : buffer[k]);
+            p_buffA[k+1] = p_buffA[k] + (qz ? cbufA[k] : bufferA[k]);
+          }
+        }
+        prof_stop(&pf, PROF_ENVELOPE);
 
         /// Just for printing a dot for approximate a million point. Not much accurate.
-        if (it%(1000000/(EPOCH-m+1))==0) {
+        if (it%(1000000/(EPOCH-mmax+1))==0) {
           //          fprintf(stderr,".");
         }
 
         /// Do main task here..
-        ex=0; ex2=0;
-        exA = 0; ex2A = 0;
         for(i=0; i<ep; i++) {
-          /// A bunch of data has been read and pick one of them at a time to use
-          d = buffer[i];
-          dA = bufferA[i];
-          
-          /// Calcualte sum and sum square
-          ex += d;
-          exA += dA;
-          
-          ex2 += d*d;
-          ex2A += dA*dA;
-          
-          /// t is a circular array for keeping current data
-          t[i%m] = d;
-          tA[i%m] = dA;
-          /// Double the size for avoiding using modulo "%" operator
-          t[(i%m)+m] = d;
-          tA[(i%m)+m] = dA;
-          
-          /// Start the task when there are more than m-1 points in the current chunk
-          if( i >= m-1 ) {
-            mean = ex/m;
-            meanA = exA/m;
-            std = ex2/m;
-            stdA = ex2A/m;
-            std = sqrt(std-mean*mean);
-            stdA = sqrt(stdA - meanA*meanA);
-            
-            /// compute the start location of the data in the current circular array, t
-            j = (i+1)%m;
-            /// the start location of the data in the current chunk
-            I = i-(m-1);
-            
-            /// Use a constant lower bound to prune the obvious subsequence
-            /// Compute both at once.
-            lb_kim = lb_kim_hierarchy(t, q, j, m, mean, std, bsf);
-            lb_kimA = lb_kim_hierarchy(tA, qA, j, m, meanA, stdA, bsfA);
-
-            if (lb_kim < bsf && lb_kimA < bsfA) {
-              /// Use a linear time lower bound to prune;
-              /// z_normalization of t will be computed on the fly.
-              /// uo, lo are envelop of the query.
-              lb_k = lb_keogh_cumulative(order, t, uo, lo, cb1, j, m, mean, std, bsf);
-              if(lb_k < bsf) {
-                lb_kA = lb_keogh_cumulative(orderA, tA, uoA, loA, cb1A, j, m, meanA, stdA, bsfA);
+          /// Check the time budget now and then; starts from base+i-mmin+1 on are not covered
+          if (budget > 0 && (i & 63) == 0 && wall_time() > budget) {
+            expired = true;
+            break;
+          }
+
+          /// Take up the better matches of other workers now and then
+          if (gbsf != NULL && (i & 255) == 0)
+            share_take(gbsf, Qs, nq, nwmax);
+
+          /// Every query length has its own starts, with means and stds from query_stats
+          for (x=0; x<nq; x++) {
+            Q = &Qs[x];
+            m = Q->m;
+            double *q = Q->q, *qA = Q->qA;
+
+            /// Start the task when there are more than m-1 points in the current chunk
+            if( i >= m-1 ) {
+              /// the start location of the data in the current chunk, and the subsequence there
+              I = i-(m-1);
+              double *t = buffer+I, *tA = bufferA+I;
+              int16_t *ct = cbuf+I, *ctA = cbufA+I;     /// or its codes, for a quantized file
+
+              /// A shorter query ending in the first mmax-1 points was done with the previous
+              /// chunk already, a start past the segment belongs to another one.
+              bool skip = (!fresh && i < mmax-1) || base+I >= send;
+
+              /// Starts in a block which can no longer beat best-so-far are skipped at once
+              long long sb = src.blocked ? (base+I)/src.hdr.block_size : 0;
+              bool blocked = !skip && src.blocked && Q->glb[sb] + Q->glbA[sb] >= Q->bsf;
+              if (skip || blocked)
+                continue;
+
+              /// Use a constant lower bound to prune the obvious subsequence
+              /// Compute both at once.
+              /// The two dimensions add up, so the second one only gets what the first left of bsf.
+              /// LB_Kim does not depend on the warping window, so it is shared by all of them.
+              /// It is done for a group of KIM_LANES starts at a time, which also tells which of
+              /// them may survive; the last starts of a chunk, short of a group, go one by one.
+              /// On a quantized file they run on the codes; on lossy ones the bounds are compared
+              /// with a widened best-so-far.
+              long long g = I - I%KIM_LANES;
+              int lane = I%KIM_LANES;
+              bool group = g+KIM_LANES <= ep-m+1;
+              Query *S = nset > 0 ? Qs : Q;     /// the queries of a set share the statistics of the starts
+              if (qz)
+                query_stats(S, cbuf, cbufA, group ? g+KIM_LANES : I+1);
+              else
+                query_stats(S, buffer, bufferA, group ? g+KIM_LANES : I+1);
+              mean = S->mu[lane];
+              std = S->sd[lane];
+              meanA = S->muA[lane];
+              stdA = S->sdA[lane];
+              double qe2 = lossy ? 4*((pe_buff[I+m]-pe_buff[I])/(std*std) + (pe_buffA[I+m]-pe_buffA[I])/(stdA*stdA)) : 0;
+              double T = widen(Q->bsf, qe2*(2*Q->win[Q->nw-1].r+1));
+
+              prof_start(&pf);
+              if (group) {
+                if (Q->kimgroup != g) {
+                  if (qz)
+                    Q->kimmask = lb_kim_block(cbuf+g, cbufA+g, q, qA, m, S->mu, S->sd, S->muA, S->sdA,
+                                              lossy ? INF : T, Q->kim);
+                  else
+                    Q->kimmask = lb_kim_block(buffer+g, bufferA+g, q, qA, m, S->mu, S->sd, S->muA, S->sdA,
+                                              T, Q->kim);
+                  Q->kimgroup = g;
+                }
+                lb_kim = Q->kim[lane];
+                lb_kimA = 0;
+              } else if (qz) {
+                lb_kim = lb_kim_hierarchy(ct, q, 0, m, mean, std, T);
+                lb_kimA = lb_kim_hierarchy(ctA, qA, 0, m, meanA, stdA, T - lb_kim);
               } else {
-                lb_kA = INF;
+                lb_kim = lb_kim_hierarchy(t, q, 0, m, mean, std, T);
+                lb_kimA = lb_kim_hierarchy(tA, qA, 0, m, meanA, stdA, T - lb_kim);
+              }
+              prof_stop(&pf, PROF_KIM);
+
+              /// Not below best-so-far when its group was done, so not below that of any window now
+              if (group && !(Q->kimmask >> lane & 1)) {
+                for (int y = 0; y < Q->nw; y++)
+                  Q->win[y].kim++;
+                continue;
               }
-              if (lb_k < bsf && lb_kA < bsfA) {
-                /// Take another linear time to compute z_normalization of t.
-                /// Note that for better optimization, this can merge to the previous function.
-                for(k=0;k<m;k++) {
-                  tz[k] = (t[(k+j)] - mean)/std;
-                  tzA[k] = (tA[k+j] - meanA)/stdA;
+
+              /// The first query of a cluster past LB_Kim checks the union envelope for all of
+              /// them, against the largest best-so-far among them
+              if (Q->group >= 0 && lb_kim + lb_kimA < T) {
+                Group *G = &groups[Q->group];
+                if (G->at != base+I) {
+                  double Tg = 0;
+                  for (k = 0; k < G->n; k++)
+                    Tg = max(Tg, Qs[G->member[k]].bsf);
+                  Tg = widen(Tg, qe2*(2*Q->win[Q->nw-1].r+1));
+                  prof_start(&pf);
+                  lb_k = qz ? lb_keogh_sorted(G->so, ct, cb1, 0, m, mean, std, Tg)
+                            : lb_keogh_sorted(G->so, t, cb1, 0, m, mean, std, Tg);
+                  if (lb_k < Tg)
+                    lb_k += qz ? lb_keogh_sorted(G->soA, ctA, cb1A, 0, m, meanA, stdA, Tg - lb_k)
+                               : lb_keogh_sorted(G->soA, tA, cb1A, 0, m, meanA, stdA, Tg - lb_k);
+                  prof_stop(&pf, PROF_KEOGH);
+                  G->at = base+I;
+                  G->pruned = !(lb_k < Tg);
                 }
-                  
-                /// Use another lb_keogh to prune
-                /// qo is the sorted query. tz is unsorted z_normalized data.
-                /// l_buff, u_buff are big envelop for all data in this chunk
-                lb_k2 = lb_keogh_data_cumulative(order, tz, qo, cb2, l_buff+I, u_buff+I, m, mean, std, bsf);
-                if(lb_k2 < bsf) {
-                  lb_k2A = lb_keogh_data_cumulative(orderA, tzA, qoA, cb2A, l_buffA+I, u_buffA+I, m, meanA, stdA, bsfA);
-                } else {
-                  lb_k2A = INF;
+                if (G->pruned) {
+                  for (int y = 0; y < Q->nw; y++)
+                    Q->win[y].grp++;
+                  continue;
                 }
-                if (lb_k2 < bsf && lb_k2A < bsf) {
-                  /// Choose better lower bound between lb_keogh and lb_keogh2
-                  /// to be used in early abandoning DTW
-                  /// Note that cb and cb2 will be cumulative summed here.
-                  if (lb_k > lb_k2) {
-                    cb[m-1]=cb1[m-1];
-                    cbA[m-1] = cb1A[m-1];
-                    for(k=m-2; k>=0; k--) {
-                      cb[k] = cb[k+1]+cb1[k];
-                      cbA[k] = cbA[k+1]+cb1A[k];
-                    }
-                  } else {
-                    cb[m-1]=cb2[m-1];
-                    cbA[m-1]=cb2A[m-1];
-                    for(k=m-2; k>=0; k--) {
-                      cb[k] = cb[k+1]+cb2[k];
-                      cbA[k] = cbA[k+1]+cb2A[k];
+              }
+
+              /// Go from the widest window to the narrowest. DTW never grows with a wider window,
+              /// so any lower bound on DTW for one window, and its DTW itself, bounds all narrower
+              /// ones as well; lb keeps the best such bound of this subsequence.
+              double lb = lb_kim + lb_kimA;
+              bool ztz = false, xtz = false;
+              double xmean = 0, xstd = 0, xmeanA = 0, xstdA = 0;
+              for (int y = Q->nw-1; y >= 0; y--) {
+                W = &Q->win[y];
+                T = widen(W->bsf, qe2*(2*W->r+1));
+                /// A constant subsequence has a NaN bound, which never passes
+                if (!(lb_kim + lb_kimA < T)) {
+                  W->kim++;
+                } else if (lb >= T) {
+                  W->wider++;
+                } else {
+                  /// Use the PAA envelope bound to prune in O(m/w) before the linear ones;
+                  /// segment means of the data come from the prefix sums of this chunk.
+                  lb_p = lb_pA = 0;
+                  if (W->w > 0) {
+                    prof_start(&pf);
+                    lb_p = lb_paa(p_buff+I, W->pl, W->pu, m, W->w, mean, std, T);
+                    if (lb_p < T) {
+                      lb_pA = lb_paa(p_buffA+I, W->plA, W->puA, m, W->w, meanA, stdA, T - lb_p);
+                      lb = max(lb, lb_p + lb_pA);
+                    } else {
+                      lb = max(lb, lb_p);
+                      lb_pA = INF;
                     }
+                    prof_stop(&pf, PROF_PAA);
                   }
-                  /// Compute DTW and early abandoning if possible
-                  double dist = dtw(tz, q, cb, m, r, bsf);
-                  double distA = INF;
-                  if(dist < bsf) {
-                    distA = dtw(tzA, qA, cbA, m, r, bsfA);
-                  } else {
-                    distA = INF;
-                  }
-                  if( dist < bsf && distA < bsfA ) {
-                    /// Update bsf
-                    /// loc is the real starting location of the nearest neighbor in the file
-                    bsf = dist;
-                    bsfA = distA;
-                    loc = (it)*(EPOCH-m+1) + i-m+1;
-                  }
-                } else
-                  keogh2++;
-              } else
-                keogh++;
-            } else
-              kim++;
-            
-            /// Reduce obsolute points from sum and sum square
-            ex -= t[j];
-            ex2 -= t[j]*t[j];
-            exA -= tA[j];
-            ex2A -= tA[j]*tA[j];
+                  if (lb_p + lb_pA < T) {
+                    /// Use a linear time lower bound to prune;
+                    /// z_normalization of t will be computed on the fly.
+                    /// uo, lo are envelop of the query.
+                    prof_start(&pf);
+                    lb_k = qz ? lb_keogh_sorted(W->so, ct, cb1, 0, m, mean, std, T)
+                              : lb_keogh_sorted(W->so, t, cb1, 0, m, mean, std, T);
+                    if(lb_k < T) {
+                      lb_kA = qz ? lb_keogh_sorted(W->soA, ctA, cb1A, 0, m, meanA, stdA, T - lb_k)
+                                 : lb_keogh_sorted(W->soA, tA, cb1A, 0, m, meanA, stdA, T - lb_k);
+                      lb = max(lb, lb_k + lb_kA);
+                    } else {
+                      lb = max(lb, lb_k);
+                      lb_kA = INF;
+                    }
+                    prof_stop(&pf, PROF_KEOGH);
+                    if (lb_k + lb_kA < T) {
+                      /// Take another linear time to compute z_normalization of t.
+                      /// Note that for better optimization, this can merge to the previous function.
+                      prof_start(&pf);
+                      if (!ztz) {
+                        for(k=0;k<m;k++) {
+                          tz[k] = ((qz ? ct[k] : t[k]) - mean)/std;
+                          tzA[k] = ((qz ? ctA[k] : tA[k]) - meanA)/stdA;
+                        }
+                        ztz = true;
+                      }
+
+                      /// Use another lb_keogh to prune
+                      /// so holds the sorted query.
+                      /// l_buff, u_buff are big envelop for all data in this chunk
+                      Envelope *E = W->env;
+                      lb_k2 = qz ? lb_keogh_data_sorted(W->so2, cb2, E->cl+I, E->cu+I, m, mean, std, T)
+                                 : lb_keogh_data_sorted(W->so2, cb2, E->l+I, E->u+I, m, mean, std, T);
+                      if(lb_k2 < T) {
+                        lb_k2A = qz ? lb_keogh_data_sorted(W->soA2, cb2A, E->clA+I, E->cuA+I, m, meanA, stdA, T - lb_k2)
+                                    : lb_keogh_data_sorted(W->soA2, cb2A, E->lA+I, E->uA+I, m, meanA, stdA, T - lb_k2);
+                        lb = max(lb, lb_k2 + lb_k2A);
+                      } else {
+                        lb = max(lb, lb_k2);
+                        lb_k2A = INF;
+                      }
+                      prof_stop(&pf, PROF_KEOGH2);
+                      if (lb_k2 + lb_k2A < T) {
+                        /// The bounds so far hold for the quantized values only. Decode the candidate
+                        /// exactly and take its own LB_Keogh for early abandoning.
+                        double *zt = tz, *ztA = tzA;
+                        if (lossy) {
+                          if (!xtz) {
+                            prof_start(&pf);
+                            source_exact(&src, base+I, m, xt, xtA);
+                            prof_stop(&pf, PROF_IO);
+                            xmean = xstd = xmeanA = xstdA = 0;
+                            for(k=0;k<m;k++) {
+                              xmean += xt[k];  xstd += xt[k]*xt[k];
+                              xmeanA += xtA[k];  xstdA += xtA[k]*xtA[k];
+                            }
+                            xmean /= m;
+                            xmeanA /= m;
+                            xstd = sqrt(xstd/m - xmean*xmean);
+                            xstdA = sqrt(xstdA/m - xmeanA*xmeanA);
+                            for(k=0;k<m;k++) {
+                              xz[k] = (xt[k] - xmean)/xstd;
+                              xzA[k] = (xtA[k] - xmeanA)/xstdA;
+                            }
+                            xtz = true;
+                          }
+                          lb_k = lb_keogh_sorted(W->so, xt, cb1, 0, m, xmean, xstd, W->bsf);
+                          lb_kA = lb_k < W->bsf ? lb_keogh_sorted(W->soA, xtA, cb1A, 0, m, xmeanA, xstdA, W->bsf - lb_k) : INF;
+                          if (!(lb_k + lb_kA < W->bsf)) {
+                            W->keogh2++;
+                            continue;
+                          }
+                          zt = xz;
+                          ztA = xzA;
+                          lb_k2 = lb_k2A = -1;
+                        }
+
+                        /// Choose better lower bound between lb_keogh and lb_keogh2
+                        /// to be used in early abandoning DTW, for each dimension
+                        /// Note that cb and cb2 will be cumulative summed here.
+                        prof_start(&pf);
+                        double *c = lb_k > lb_k2 ? cb1 : cb2;
+                        double *cA = lb_kA > lb_k2A ? cb1A : cb2A;
+                        cb[m-1] = c[m-1];
+                        cbA[m-1] = cA[m-1];
+                        for(k=m-2; k>=0; k--) {
+                          cb[k] = cb[k+1]+c[k];
+                          cbA[k] = cbA[k+1]+cA[k];
+                        }
+
+                        /// Compute DTW and early abandoning if possible
+                        /// The first dimension is abandoned once it cannot win together with the bound of the second.
+                        double lbA = max(lb_kA, lb_k2A);
+                        double dist = W->K.dtw(zt, q, cb, m, W->r, W->bsf - lbA);
+                        W->dtwc++;
+                        double distA = INF;
+                        if(dist + lbA < W->bsf) {
+                          distA = W->K.dtw(ztA, qA, cbA, m, W->r, W->bsf - dist);
+                          lb = max(lb, dist + distA);
+                        } else {
+                          lb = max(lb, dist + lbA);
+                          distA = INF;
+                        }
+                        prof_stop(&pf, PROF_DTW);
+                        if( dist + distA < W->bsf ) {
+                          /// Update bsf
+                          /// loc is the real starting location of the nearest neighbor in the file
+                          W->bsf = dist + distA;
+                          W->bsfd = dist;
+                          W->bsfdA = distA;
+                          W->loc = base + i-m+1;
+                          Q->bsf = Q->win[0].bsf;
+                          for (k=1; k<Q->nw; k++)
+                            Q->bsf = max(Q->bsf, Q->win[k].bsf);
+                          if (gbsf != NULL)
+                            share_put(&gbsf[x*nwmax+y], W->bsf);
+                        }
+                      } else
+                        W->keogh2++;
+                    } else
+                      W->keogh++;
+                  } else
+                    W->paa++;
+                }
+              }
+            }
+          }
+        }
+
+        /// Report a better match after every chunk of the anytime search
+        for (x=0; budget >= 0 && x<nq; x++) {
+          Q = &Qs[x];
+          for (k=0; k<Q->nw; k++) {
+            W = &Q->win[k];
+            if (W->bsf < W->shown) {
+              W->shown = W->bsf;
+              fprintf(stderr, "Best : %lld, Distance %g, %.3f sec", W->loc, sqrt(W->bsf), wall_time());
+              if (nstarts > 0)
+                fprintf(stderr, ", %.2f%% covered", 100.0*(segdone + max(0, base + i-mmin+1 - segp))/nstarts);
+              if (nset > 0)
+                fprintf(stderr, ", query %d", Q->id);
+              else if (nq > 1)
+                fprintf(stderr, ", m = %d", Q->m);
+              if (Q->nw > 1)
+                fprintf(stderr, ", R = %g", W->R);
+              fprintf(stderr, "\n");
+            }
           }
         }
-        
+
         /// If the size of last chunk is less then EPOCH, then no more data and terminate.
-        if (ep<EPOCH) {
+        if (expired) {
+          covered = segdone + max(0, base + i-mmin+1 - segp);
+          done = true;
+        } else if (ep<EPOCH && !gap) {
           done=true;
         } else {
           it++;
         }
       }
+
+      /// The segment is done, go on with the next one in the visiting order
+      if (done && !expired && seg < nseg) {
+        segdone += min(EPOCH-mmax+1, nstarts-segp);
+        segp = segs[seg++]*(EPOCH-mmax+1);
+        send = segp+EPOCH-mmax+1;
+        source_seek(&src, segp, min(segp+EPOCH, src.hdr.n));
+        done = false;
+        gap = true;
+      }
+
+      /// Save the state now and then; a chunk always starts from here, whatever came before
+      if (!done && ckname != NULL && wall_time() - ckt >= ckevery) {
+        ck.next = src.next;
+        ck.offset = src.blocked ? 0 : ftello(fp);
+        ck.b = src.b;
+        ck.end = src.end;
+        ck.len = src.len;
+        ck.pos = src.pos;
+        ck.base = base;
+        ck.skipped = skipped;
+        ck.seg = seg;
+        ck.segp = segp;
+        ck.segdone = segdone;
+        ck.send = send;
+        ck.it = it;
+        ck.gap = gap;
+        ck.seedt = seedt;
+        ck.cpu = (clock()-t1)/CLOCKS_PER_SEC;
+        checkpoint_write(ckname, &ck, Qs, nq, tail);
+        ckt = wall_time();
+      }
+    }
+
+    /// A finished scan needs no checkpoint any more; one stopped by the time budget keeps it
+    if (ckname != NULL && !expired)
+      remove(ckname);
+
+    /// Fraction of the start positions which were searched or ruled out by a bound.
+    /// The size of a text file is only known in bytes: the starts of the points read so far
+    /// are scaled by the part of the file they took up.
+    double coverage = 1;
+    i = src.blocked ? src.hdr.n : src.next;
+    if (!expired)
+      covered = max(0, i-mmin+1);
+    else if (src.blocked)
+      coverage = (double)covered/nstarts;
+    else {
+      off_t at = ftello(fp);
+      fseeko(fp, 0, SEEK_END);
+      coverage = (double)covered/max(1, i-mmin+1)*at/ftello(fp);
     }
-               
-    i = (it)*(EPOCH-m+1) + ep;
+
     fclose(fp);
+    free(segs);
+
+    for (x=0; x<nq; x++) {
+      Q = &Qs[x];
+      for (k=0; k<Q->nw; k++) {
+        W = &Q->win[k];
+
+        /// The seed itself was never beaten or found again
+        if (W->bsf == W->seedbsf)
+          W->bsf = W->seed;
+
+        /// Every start which did not go through the cascade was ruled out by its block
+        long long n = min(covered, max(0, i-Q->m+1));
+        if (me >= 0)
+          n = max(0, min(n, shards[me].to) - shards[me].from);
+        W->blk = max(0, n - (W->kim+W->paa+W->keogh+W->keogh2+W->wider+W->dtwc+W->grp));
+      }
+    }
+
+    /// A worker leaves its results to the coordinator and is done
+    if (me >= 0) {
+      for (x=0; x<nq; x++)
+        for (k=0; k<Qs[x].nw; k++) {
+          W = &Qs[x].win[k];
+          ShardWindow *r = &sw[me*nwin + x*nwmax+k];
+          r->bsf = W->loc >= 0 ? W->bsf : INF;
+          r->bsfd = W->bsfd;
+          r->bsfdA = W->bsfdA;
+          r->loc = W->loc;
+          r->seed = W->seed;
+          r->seedloc = W->seedloc;
+          r->kim = W->kim;
+          r->paa = W->paa;
+          r->keogh = W->keogh;
+          r->keogh2 = W->keogh2;
+          r->wider = W->wider;
+          r->dtwc = W->dtwc;
+          r->blk = W->blk;
+        }
+      shards[me].skipped = skipped;
+      shards[me].seedt = seedt;
+      if (pf.on) {
+        prof_close(&pf);
+        spf[me] = pf;
+      }
+      exit(0);
+    }
+
+    /// The coordinator merges: the best match of every window, the first file and location
+    /// among equal distances, and the sums of the counters
+    if (shards != NULL) {
+      i = npoints;
+      skipped = 0;
+      for (int s = 0; s < nshards; s++) {
+        skipped += shards[s].skipped;
+        seedt = max(seedt, shards[s].seedt);
+        if (pf.on)
+          prof_add(&pf, &spf[s]);
+      }
+      for (x=0; x<nq; x++)
+        for (k=0; k<Qs[x].nw; k++) {
+          W = &Qs[x].win[k];
+          W->blk = 0;
+          for (int s = 0; s < nshards; s++) {
+            ShardWindow *r = &sw[s*nwin + x*nwmax+k];
+            W->kim += r->kim;
+            W->paa += r->paa;
+            W->keogh += r->keogh;
+            W->keogh2 += r->keogh2;
+            W->wider += r->wider;
+            W->dtwc += r->dtwc;
+            W->blk += r->blk;
+            if (r->bsf < W->bsf || (r->bsf == W->bsf && r->loc >= 0 &&
+                (shards[s].file < W->file || (shards[s].file == W->file && r->loc < W->loc)))) {
+              W->bsf = r->bsf;
+              W->bsfd = r->bsfd;
+              W->bsfdA = r->bsfdA;
+              W->loc = r->loc;
+              W->file = shards[s].file;
+            }
+            if (r->seedloc >= 0 && r->seed < W->seed) {
+              W->seed = r->seed;
+              W->seedloc = r->seedloc;
+            }
+          }
+        }
+    }
+
+    /// The percentages of the report are of the starts that were covered, and after the
+    /// merge of a sharded search of all of them
+    long long den = expired ? max(1, covered) : i;
 
-    free(q);
-    free(u);
-    free(l);
-    free(uo);
-    free(lo);
-    free(qo);
-    free(tz);
-    free(t);
-    free(l_d);
-    free(u_d);
-    free(l_buff);
-    free(u_buff);
 
     t2 = clock();
-    /*    printf("\n");
 
-    /// Note that loc and i are long long.
-    cout << "Location : " << loc << endl;
-    cout << "Distance(1) : " << sqrt(bsf) << endl;
-    cout << "Distance(2) : " << sqrt(bsfA) << endl; 
-    cout << "Data Scanned : " << i << endl;
-    cout << "Total Execution Time : " << (t2-t1)/CLOCKS_PER_SEC << " sec" << endl;
+    /// The workers ran side by side, so a sharded search reports the wall clock time
+    if (shards != NULL) {
+      t1 = 0;
+      t2 = wall_time()*CLOCKS_PER_SEC;
+    }
 
-    /// printf is just easier for formating ;)
-    printf("\n");
-    printf("Pruned by LB_Kim    : %6.7f%%\n", ((double) kim / i)*100);
-    printf("Pruned by LB_Keogh  : %6.7f%%\n", ((double) keogh / i)*100);
-    printf("Pruned by LB_Keogh2 : %6.7f%%\n", ((double) keogh2 / i)*100);
-    printf("DTW Calculation     : %6.7f%%\n", 100-(((double)kim+keogh+keogh2)/i*100));
-    */
-    double kimp = ((double) kim / i)*100;
-    double keop = ((double) keogh / i)*100;
-    double keo2p = ((double) keogh2 / i)*100;
-    double dtwp  = 100-(((double)kim+keogh+keogh2)/i*100);
-    cout << kimp << "," << keop << "," << keo2p << "," << dtwp << "," << (t2-t1)/CLOCKS_PER_SEC << endl;    
+    if (verbose) {
+      /// Note that loc and i are long long.
+      for (x=0; x<nq; x++) {
+        Q = &Qs[x];
+        for (k=0; k<Q->nw; k++) {
+          W = &Q->win[k];
+          if (nset > 0)
+            cout << "Query " << Q->id << (Q->nw > 1 ? ", " : "\n");
+          else if (nq > 1)
+            cout << "m = " << Q->m << (Q->nw > 1 ? ", " : "\n");
+          if (Q->nw > 1)
+            cout << "R = " << W->R << " (r = " << W->r << ")" << endl;
+          cout << "Location : " << W->loc << endl;
+          if (nfiles > 1)
+            cout << "File : " << files[W->file] << endl;
+          cout << "Distance : " << sqrt(W->bsf) << endl;
+          cout << "Distance(1) : " << sqrt(W->bsfd) << endl;
+          cout << "Distance(2) : " << sqrt(W->bsfdA) << endl;
+          if (norm)
+            cout << "Distance per point : " << sqrt(W->bsf/Q->m) << endl;
+        }
+      }
+
+      /// The best length for every R, by distance or by distance per point
+      for (k=0; nq > 1 && nset == 0 && k<Qs[0].nw; k++) {
+        Query *bq = NULL;
+        Window *bw = NULL;
+        for (x=0; x<nq; x++)
+          for (int y=0; y<Qs[x].nw; y++) {
+            W = &Qs[x].win[y];
+            if (W->id == k && (bw == NULL || (norm ? W->bsf/Qs[x].m < bw->bsf/bq->m : W->bsf < bw->bsf))) {
+              bq = &Qs[x];
+              bw = W;
+            }
+          }
+        cout << "Best Length : " << bq->m;
+        if (bq->nw > 1)
+          cout << ", R = " << bw->R;
+        cout << ", Location " << bw->loc << ", Distance " << sqrt(bw->bsf);
+        if (norm)
+          cout << ", per point " << sqrt(bw->bsf/bq->m);
+        cout << endl;
+      }
+
+      if (nset > 0)
+        cout << "Queries : " << nset << ", in " << ng << " clusters of more than one" << endl;
+      if (ordernote != NULL)
+        cout << "Order : " << ordernote << " " << ordername << endl;
+      cout << "Data Scanned : " << i << endl;
+      cout << "Total Execution Time : " << (t2-t1)/CLOCKS_PER_SEC << " sec" << endl;
+      if (budget >= 0)
+        cout << "Coverage : " << coverage*100 << "%" << (expired ? ", stopped at the time limit" : "") << endl;
+      for (x=0; seedn != 0 && x<nq; x++)
+        for (k=0; k<Qs[x].nw; k++)
+          cout << "Seed : " << Qs[x].win[k].seedloc << ", Distance " << sqrt(Qs[x].win[k].seed) << ", "
+               << (seedn > 0 ? "sampled" : "Euclidean pass") << " in " << seedt << " sec" << endl;
+
+      /// printf is just easier for formating ;)
+      for (x=0; x<nq; x++) {
+        Q = &Qs[x];
+        for (k=0; k<Q->nw; k++) {
+          W = &Q->win[k];
+          printf("\n");
+          if (nset > 0)
+            printf("Query %d%s", Q->id, Q->nw > 1 ? ", " : "\n");
+          else if (nq > 1)
+            printf("m = %d%s", Q->m, Q->nw > 1 ? ", " : "\n");
+          if (Q->nw > 1)
+            printf("R = %g (r = %d)\n", W->R, W->r);
+          if (src.blocked)
+            printf("Pruned by Blocks    : %6.7f%%\n", ((double) W->blk / den)*100);
+          printf("Pruned by LB_Kim    : %6.7f%%\n", ((double) W->kim / den)*100);
+          if (W->w > 0)
+            printf("Pruned by LB_PAA    : %6.7f%% (segment width %d)\n", ((double) W->paa / den)*100, W->w);
+          printf("Pruned by LB_Keogh  : %6.7f%%\n", ((double) W->keogh / den)*100);
+          printf("Pruned by LB_Keogh2 : %6.7f%%\n", ((double) W->keogh2 / den)*100);
+          if (Q->nw > 1)
+            printf("Pruned by wider R   : %6.7f%%\n", ((double) W->wider / den)*100);
+          if (Q->group >= 0)
+            printf("Pruned by cluster   : %6.7f%% (cluster %d)\n", ((double) W->grp / den)*100, Q->group);
+          printf("DTW Calculation     : %6.7f%%\n", 100-(((double)W->kim+W->paa+W->keogh+W->keogh2+W->wider+W->blk+W->grp)/den*100));
+        }
+      }
+      if (src.blocked)
+        printf("Skipped blocks      : %lld of %lld (block size %d)\n", skipped, shards != NULL ? nblocks : src.hdr.nblocks,
+               src.hdr.block_size);
+    } else {
+      /// One line per length and window; a range starts each line with m, a sweep with R.
+      /// The percentages add up to 100: a sweep adds the column of wider R, a set that of
+      /// the clusters, just before DTW.
+      for (x=0; x<nq; x++) {
+        Q = &Qs[x];
+        for (k=0; k<Q->nw; k++) {
+          W = &Q->win[k];
+          double blkp = ((double) W->blk / den)*100;
+          double kimp = ((double) W->kim / den)*100;
+          double paap = ((double) W->paa / den)*100;
+          double keop = ((double) W->keogh / den)*100;
+          double keo2p = ((double) W->keogh2 / den)*100;
+          double dtwp  = 100-(((double)W->kim+W->paa+W->keogh+W->keogh2+W->wider+W->blk+W->grp)/den*100);
+          if (nset > 0)
+            cout << Q->id << ",";
+          else if (nq > 1)
+            cout << Q->m << ",";
+          if (Q->nw > 1)
+            cout << W->R << ",";
+          cout << blkp << "," << kimp << "," << paap << "," << keop << "," << keo2p << ",";
+          if (Q->nw > 1)
+            cout << ((double) W->wider / den)*100 << ",";
+          if (nset > 0)
+            cout << ((double) W->grp / den)*100 << ",";
+          cout << dtwp << "," << (t2-t1)/CLOCKS_PER_SEC << endl;
+        }
+      }
+    }
+    prof_report(&pf);
+    prof_close(&pf);
+    arena_free(&arena);
+    free(bsum);
+    block_free_header(&src.hdr);
+    free(files);
+    free(datalist);
     return 0;
 }
@@ -24,11 +24,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <iostream>
 
 #define INF 1e20       //Pseudo Infitinte number for this code
+#define RUN 16         //Length of the runs of the query order with -runs
 
 using namespace std;
 
@@ -41,10 +43,14 @@ typedef struct Index
 
 /// Comparison function for sorting the query.
 /// The query will be sorted by absolute z-normalization value, |z_norm(Q[i])| from high to low.
+/// The values are compared as doubles; ties keep the order of their index.
 int comp(const void *a, const void* b)
 {   Index* x = (Index*)a;
     Index* y = (Index*)b;
-    return abs(y->value) - abs(x->value);
+    double ax = fabs(x->value), ay = fabs(y->value);
+    if (ax != ay)
+        return ax < ay ? 1 : -1;
+    return (x->index > y->index) - (x->index < y->index);
 }
 
 
@@ -76,8 +82,9 @@ void error(int id)
     else if ( id == 4 )
     {
         printf("ERROR: Invalid Number of Arguments!!!\n");
-        printf("Command Usage:   UCR_ED.exe  data_file  query_file   m   \n");
+        printf("Command Usage:   UCR_ED.exe  data_file  query_file   m   [-runs]\n");
         printf("For example  :   UCR_ED.exe  data.txt   query.txt   128  \n");
+        printf("-runs orders the query in runs of %d consecutive points, for the cache\n", RUN);
     }
     exit(1);
 }
@@ -94,6 +101,7 @@ int main(  int argc , char *argv[] )
     int *order;            // ordering of query by |z(q_i)|
     double bsf;            // best-so-far
     int m;                 // length of query
+    int run = 1;           // length of the runs of the query order, 1 for exact
     long long loc = 0;     // answer: location of the best-so-far match
 
     double d;
@@ -120,6 +128,11 @@ int main(  int argc , char *argv[] )
         exit(2);
 
     m = atol(argv[3]);
+    if (argc > 4)
+    {   if (strcmp(argv[4], "-runs") != 0)
+            error(4);
+        run = RUN;
+    }
 
     /// Array for keeping the query data
     Q = (double *)malloc(sizeof(double)*m);
@@ -143,24 +156,35 @@ int main(  int argc , char *argv[] )
     for( i = 0 ; i < m ; i++ )
          Q[i] = (Q[i] - mean)/std;
 
-    /// Sort the query data
+    /// Sort the query data by |Q[i]|, or with -runs in runs of RUN consecutive points ranked
+    /// by their mean |Q[i]|: the reads of T stay sequential within a run.
     order = (int *)malloc(sizeof(int)*m);
     if( order == NULL )
         error(1);
-    Index *Q_tmp = (Index *)malloc(sizeof(Index)*m);
-    if( Q_tmp == NULL )
+    int nr = (m+run-1)/run;
+    Index *Q_tmp = (Index *)malloc(sizeof(Index)*nr);
+    double *Q_val = (double *)malloc(sizeof(double)*m);
+    if( Q_tmp == NULL || Q_val == NULL )
         error(1);
-    for( i = 0 ; i < m ; i++ )
+    for( int k = 0 ; k < nr ; k++ )
     {
-        Q_tmp[i].value = Q[i];
-        Q_tmp[i].index = i;
-    }
-    qsort(Q_tmp, m, sizeof(Index),comp);
-    for( i=0; i<m; i++)
-    {   Q[i] = Q_tmp[i].value;
-        order[i] = Q_tmp[i].index;
+        Q_tmp[k].value = 0;
+        Q_tmp[k].index = k;
+        for( i = k*run ; i < m && i < (k+1)*run ; i++ )
+            Q_tmp[k].value += fabs(Q[i]);
+        Q_tmp[k].value /= i - k*run;
     }
+    qsort(Q_tmp, nr, sizeof(Index),comp);
+    j = 0;
+    for( int k = 0 ; k < nr ; k++ )
+        for( i = Q_tmp[k].index*run ; i < m && i < (Q_tmp[k].index+1)*run ; i++, j++ )
+        {   Q_val[j] = Q[i];
+            order[j] = i;
+        }
+    for( i = 0 ; i < m ; i++ )
+        Q[i] = Q_val[i];
     free(Q_tmp);
+    free(Q_val);
 
 
 
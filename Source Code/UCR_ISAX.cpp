@@ -0,0 +1,778 @@
+/***********************************************************************/
+/** UCR_ISAX: indexed DTW search over a block file.                   **/
+/**                                                                   **/
+/** "build" writes an on-disk iSAX index over all z-normalized        **/
+/** subsequences of length m: each one gets a word of 8-bit symbols,  **/
+/** SEGMENTS per dimension. Entries are sorted by their interleaved   **/
+/** symbol bits, so similar words end up in the same leaf, and leaves **/
+/** are grouped into nodes. Leaves and nodes keep the symbol range of **/
+/** their entries.                                                    **/
+/**                                                                   **/
+/** "search" visits the leaves best first by a lower bound of DTW and **/
+/** returns the best subsequence of the first few. With -exact the    **/
+/** search goes on with that answer as best-so-far, pruning whole     **/
+/** nodes and leaves, and checks the rest with the UCR_DTW cascade.   **/
+/***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <queue>
+#include <vector>
+#include "ucr_block.h"
+#include "ucr_dtw.h"
+
+using namespace std;
+
+#define SEGMENTS     8              /// PAA segments per dimension
+#define WORD         (2*SEGMENTS)   /// symbols in a word, both dimensions
+#define CARD         256            /// symbols per segment (8 bits)
+#define RUN          (1<<22)        /// entries sorted in memory at once while building
+#define ISAX_MAGIC   "UCRISX1"
+#define ISAX_VERSION 1
+
+/// Fixed size header at the beginning of an index file.
+/// Layout: header | positions of all entries | leaves | nodes
+typedef struct IsaxHeader
+    {   char      magic[8];
+        int       version;
+        int       m;               /// length of the indexed subsequences
+        int       leaf_size;       /// entries per leaf
+        int       fanout;          /// leaves per node
+        long long n;               /// points in the data file
+        long long entries;         /// indexed subsequences
+        long long nleaves, nnodes;
+        long long leaf_offset, node_offset;
+    } IsaxHeader;
+
+/// Entry while building: interleaved word and start position
+typedef struct Entry
+    {   unsigned char key[WORD];
+        long long     pos;
+    } Entry;
+
+/// Leaf (range of entries) or node (range of leaves) with the symbol range of everything in it
+typedef struct Node
+    {   long long     first;
+        int           count;
+        unsigned char lo[WORD], hi[WORD];
+    } Node;
+
+/// Query of one dimension, prepared as in UCR_DTW
+typedef struct Query
+    {   double *q, *qo, *uo, *lo;  /// z-normalized query, sorted query and sorted envelope
+        int    *order;
+        double *pl, *pu;           /// envelope per PAA segment of the index
+    } Query;
+
+/// Breakpoints of N(0,1): symbol k covers [brk[k], brk[k+1])
+static double brk[CARD+1];
+
+/// If serious error happens, terminate the program.
+void error(int id)
+{
+    if(id==1)
+        printf("ERROR : Memory can't be allocated!!!\n\n");
+    else if ( id == 2 )
+        printf("ERROR : File not Found!!!\n\n");
+    else if ( id == 3 )
+        printf("ERROR : Can't create Output File!!!\n\n");
+    else if ( id == 4 )
+    {
+        printf("ERROR: Invalid Number of Arguments!!!\n");
+        printf("Command Usage:   UCR_ISAX.exe  build   block_file  index_file  m  [leaf_size]\n");
+        printf("                 UCR_ISAX.exe  search  block_file  index_file  query_file  R  [-l leaves] [-exact]\n");
+        printf("For example  :   UCR_ISAX.exe  build   data.blk  data.isx  128\n");
+        printf("                 UCR_ISAX.exe  search  data.blk  data.isx  query.txt  0.05  -exact\n");
+    }
+    else if ( id == 5 )
+        printf("ERROR : Not a block file or index file, or they do not match!!!\n\n");
+    exit(1);
+}
+
+/// Equiprobable breakpoints of the standard normal distribution, found by bisection
+void init_breakpoints()
+{
+    brk[0] = -INF;
+    brk[CARD] = INF;
+    for (int k = 1; k < CARD; k++)
+    {
+        double a = -10, b = 10, p = (double)k/CARD;
+        for (int it = 0; it < 100; it++)
+        {
+            double x = (a+b)/2;
+            if (0.5*erfc(-x/sqrt(2.0)) < p)
+                a = x;
+            else
+                b = x;
+        }
+        brk[k] = (a+b)/2;
+    }
+}
+
+/// Symbol of a PAA value
+int symbol(double v)
+{
+    int a = 0, b = CARD-1;
+    while (a < b)
+    {
+        int c = (a+b+1)/2;
+        if (brk[c] <= v)
+            a = c;
+        else
+            b = c-1;
+    }
+    return a;
+}
+
+/// First position of segment s
+static inline int seg_start(int s, int m)
+{
+    return (int)((long long)s*m/SEGMENTS);
+}
+
+/// Interleave the bits of a word, most significant bits of all symbols first,
+/// so that sorting the keys groups words by their coarse shape.
+void interleave(const unsigned char *sax, unsigned char *key)
+{
+    memset(key, 0, WORD);
+    for (int b = 0, k = 0; b < 8; b++)
+        for (int s = 0; s < WORD; s++, k++)
+            if (sax[s] & (0x80 >> b))
+                key[k/8] |= 0x80 >> (k%8);
+}
+
+/// Undo interleave
+void deinterleave(const unsigned char *key, unsigned char *sax)
+{
+    memset(sax, 0, WORD);
+    for (int b = 0, k = 0; b < 8; b++)
+        for (int s = 0; s < WORD; s++, k++)
+            if (key[k/8] & (0x80 >> (k%8)))
+                sax[s] |= 0x80 >> b;
+}
+
+/// Sorting function for entries, by key then by position
+int comp_entry(const void *a, const void* b)
+{   Entry* x = (Entry*)a;
+    Entry* y = (Entry*)b;
+    int c = memcmp(x->key, y->key, WORD);
+    if (c != 0)
+        return c;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/// Sorting function for start positions, low to high
+int comp_position(const void *a, const void* b)
+{   long long x = *(long long*)a;
+    long long y = *(long long*)b;
+    return (x > y) - (x < y);
+}
+
+/// Order of the runs in the merge by their current entry, smallest on top
+struct RunOrder
+{   std::vector<Entry> *head;
+    bool operator()(int a, int b) const
+    {   return comp_entry(&(*head)[a], &(*head)[b]) > 0;
+    }
+};
+
+/// Widen the symbol range of a node by a word
+void node_add(Node *nd, const unsigned char *sax)
+{
+    for (int s = 0; s < WORD; s++)
+    {
+        nd->lo[s] = min(nd->lo[s], sax[s]);
+        nd->hi[s] = max(nd->hi[s], sax[s]);
+    }
+}
+
+/// Widen the symbol range of a node by another node
+void node_merge(Node *nd, const Node *o)
+{
+    node_add(nd, o->lo);
+    node_add(nd, o->hi);
+}
+
+/// Start an empty node
+void node_init(Node *nd, long long first)
+{
+    nd->first = first;
+    nd->count = 0;
+    memset(nd->lo, CARD-1, WORD);
+    memset(nd->hi, 0, WORD);
+}
+
+/// Write a sorted run of entries to a temporary file
+FILE *write_run(Entry *run, long long len)
+{
+    FILE *tf = tmpfile();
+    if (tf == NULL)
+        error(3);
+    qsort(run, len, sizeof(Entry), comp_entry);
+    if (fwrite(run, sizeof(Entry), len, tf) != (size_t)len)
+        error(3);
+    rewind(tf);
+    return tf;
+}
+
+/// Build the index.
+/// The data is read in chunks as in UCR_DTW, with m-1 points of overlap. Segment sums of every
+/// subsequence come from prefix sums of the chunk. Sorted runs of entries are merged into leaves.
+void build(const char *data_file, const char *index_file, int m, int leaf_size)
+{
+    FILE *fp, *out;
+    BlockHeader bh;
+    IsaxHeader h;
+    int EPOCH = 1<<20;
+    double *x, *y, *P[2], *P2[2];
+    double *bx, *by;
+    Entry *run;
+    long long len = 0, I, p;
+    std::vector<FILE *> runs;
+    std::vector<Node> leaves, nodes;
+    unsigned char sax[WORD];
+    int ep, k, s, d;
+
+    fp = fopen(data_file, "rb");
+    if (fp == NULL)
+        error(2);
+    if (!block_read_header(fp, &bh))
+        error(5);
+    if (m < SEGMENTS || m > EPOCH/2)
+        error(4);
+
+    x = (double *)malloc(sizeof(double)*EPOCH);
+    y = (double *)malloc(sizeof(double)*EPOCH);
+    bx = (double *)malloc(sizeof(double)*bh.block_size);
+    by = (double *)malloc(sizeof(double)*bh.block_size);
+    run = (Entry *)malloc(sizeof(Entry)*RUN);
+    if (x == NULL || y == NULL || bx == NULL || by == NULL || run == NULL)
+        error(1);
+    for (d = 0; d < 2; d++)
+    {
+        P[d] = (double *)malloc(sizeof(double)*(EPOCH+1));
+        P2[d] = (double *)malloc(sizeof(double)*(EPOCH+1));
+        if (P[d] == NULL || P2[d] == NULL)
+            error(1);
+    }
+
+    /// Words of all subsequences, chunk by chunk
+    long long b = 0, base = 0;
+    int bpos = 0, blen = 0;
+    ep = 0;
+    while (true)
+    {
+        /// keep the last m-1 points and fill the rest of the chunk
+        while (ep < EPOCH)
+        {
+            if (bpos == blen)
+            {
+                if (b >= bh.nblocks)
+                    break;
+                blen = block_read(fp, &bh, b++, bx, by);
+                bpos = 0;
+                if (blen == 0)
+                    error(5);
+            }
+            x[ep] = bx[bpos];
+            y[ep] = by[bpos];
+            bpos++;
+            ep++;
+        }
+        if (ep < m)
+            break;
+
+        double *v[2] = { x, y };
+        for (d = 0; d < 2; d++)
+        {
+            P[d][0] = P2[d][0] = 0;
+            for (k = 0; k < ep; k++)
+            {
+                P[d][k+1] = P[d][k] + v[d][k];
+                P2[d][k+1] = P2[d][k] + v[d][k]*v[d][k];
+            }
+        }
+        for (I = 0; I+m <= ep; I++)
+        {
+            bool flat = false;
+            for (d = 0; d < 2; d++)
+            {
+                double mean = (P[d][I+m]-P[d][I])/m;
+                double std = (P2[d][I+m]-P2[d][I])/m;
+                std = std - mean*mean;
+                if (!(std > 0))
+                {   flat = true;
+                    break;
+                }
+                std = sqrt(std);
+                for (s = 0; s < SEGMENTS; s++)
+                {
+                    int a = seg_start(s, m), e = seg_start(s+1, m);
+                    double paa = ((P[d][I+e]-P[d][I+a])/(e-a) - mean)/std;
+                    sax[d*SEGMENTS+s] = symbol(paa);
+                }
+            }
+            /// A constant subsequence has no z-normalization and is never a match
+            if (flat)
+                continue;
+            interleave(sax, run[len].key);
+            run[len].pos = base + I;
+            if (++len == RUN)
+            {
+                runs.push_back(write_run(run, len));
+                len = 0;
+            }
+        }
+
+        if (ep < EPOCH)
+            break;
+        for (k = 0; k < m-1; k++)
+        {
+            x[k] = x[EPOCH-m+1+k];
+            y[k] = y[EPOCH-m+1+k];
+        }
+        base += EPOCH-m+1;
+        ep = m-1;
+    }
+    fclose(fp);
+    if (len > 0)
+        runs.push_back(write_run(run, len));
+
+    out = fopen(index_file, "wb");
+    if (out == NULL)
+        error(3);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ISAX_MAGIC, sizeof(ISAX_MAGIC));
+    h.version = ISAX_VERSION;
+    h.m = m;
+    h.leaf_size = leaf_size;
+    h.fanout = 64;
+    h.n = bh.n;
+    if (fwrite(&h, sizeof(h), 1, out) != 1)
+        error(3);
+
+    /// Merge the runs; every leaf_size entries make a leaf
+    std::vector<Entry> head(runs.size());
+    RunOrder order = { &head };
+    std::priority_queue< int, std::vector<int>, RunOrder > heap(order);
+    Node leaf;
+    node_init(&leaf, 0);
+    for (k = 0; k < (int)runs.size(); k++)
+        if (fread(&head[k], sizeof(Entry), 1, runs[k]) == 1)
+            heap.push(k);
+    while (!heap.empty())
+    {
+        k = heap.top();
+        heap.pop();
+        p = head[k].pos;
+        if (fwrite(&p, sizeof(p), 1, out) != 1)
+            error(3);
+        deinterleave(head[k].key, sax);
+        node_add(&leaf, sax);
+        if (++leaf.count == leaf_size)
+        {
+            leaves.push_back(leaf);
+            node_init(&leaf, h.entries+1);
+        }
+        h.entries++;
+        if (fread(&head[k], sizeof(Entry), 1, runs[k]) == 1)
+            heap.push(k);
+    }
+    if (leaf.count > 0)
+        leaves.push_back(leaf);
+    for (k = 0; k < (int)runs.size(); k++)
+        fclose(runs[k]);
+
+    /// Nodes over consecutive leaves
+    for (long long l = 0; l < (long long)leaves.size(); l++)
+    {
+        if (l % h.fanout == 0)
+        {   Node nd;
+            node_init(&nd, l);
+            nodes.push_back(nd);
+        }
+        node_merge(&nodes.back(), &leaves[l]);
+        nodes.back().count++;
+    }
+
+    h.nleaves = leaves.size();
+    h.nnodes = nodes.size();
+    h.leaf_offset = (long long)ftello(out);
+    if (h.nleaves > 0 && fwrite(&leaves[0], sizeof(Node), h.nleaves, out) != (size_t)h.nleaves)
+        error(3);
+    h.node_offset = (long long)ftello(out);
+    if (h.nnodes > 0 && fwrite(&nodes[0], sizeof(Node), h.nnodes, out) != (size_t)h.nnodes)
+        error(3);
+    rewind(out);
+    if (fwrite(&h, sizeof(h), 1, out) != 1)
+        error(3);
+    fclose(out);
+
+    free(x);
+    free(y);
+    free(bx);
+    free(by);
+    free(run);
+    for (d = 0; d < 2; d++)
+    {   free(P[d]);
+        free(P2[d]);
+    }
+
+    cout << "Subsequences : " << h.entries << endl;
+    cout << "Leaves : " << h.nleaves << " of " << leaf_size << " entries" << endl;
+    cout << "Nodes : " << h.nnodes << " of " << h.fanout << " leaves" << endl;
+}
+
+/// z-normalize the query, build its envelope, sort it as UCR_DTW does, and reduce the
+/// envelope to the PAA segments of the index.
+void prepare_query(double *q, int m, int r, Query *Q)
+{
+    double ex = 0, ex2 = 0, mean, std;
+    double *l, *u;
+    int i;
+
+    Q->q = q;
+    Q->qo = (double *)malloc(sizeof(double)*m);
+    Q->uo = (double *)malloc(sizeof(double)*m);
+    Q->lo = (double *)malloc(sizeof(double)*m);
+    Q->order = (int *)malloc(sizeof(int)*m);
+    Q->pl = (double *)malloc(sizeof(double)*SEGMENTS);
+    Q->pu = (double *)malloc(sizeof(double)*SEGMENTS);
+    l = (double *)malloc(sizeof(double)*m);
+    u = (double *)malloc(sizeof(double)*m);
+    if (Q->qo == NULL || Q->uo == NULL || Q->lo == NULL || Q->order == NULL ||
+        Q->pl == NULL || Q->pu == NULL || l == NULL || u == NULL)
+        error(1);
+
+    for (i = 0; i < m; i++)
+    {   ex += q[i];
+        ex2 += q[i]*q[i];
+    }
+    mean = ex/m;
+    std = sqrt(ex2/m - mean*mean);
+    for (i = 0; i < m; i++)
+        q[i] = (q[i] - mean)/std;
+
+    lower_upper_lemire(q, m, r, l, u);
+    query_order(q, m, Q->order, 1);
+    for (i = 0; i < m; i++)
+    {   int o = Q->order[i];
+        Q->qo[i] = q[o];
+        Q->uo[i] = u[o];
+        Q->lo[i] = l[o];
+    }
+
+    for (int s = 0; s < SEGMENTS; s++)
+    {
+        int a = seg_start(s, m), e = seg_start(s+1, m);
+        Q->pl[s] = l[a];
+        Q->pu[s] = u[a];
+        for (i = a+1; i < e; i++)
+        {   Q->pl[s] = min(Q->pl[s], l[i]);
+            Q->pu[s] = max(Q->pu[s], u[i]);
+        }
+    }
+    free(l);
+    free(u);
+}
+
+/// Lower bound of DTW for every subsequence under a leaf or node.
+/// The PAA value of such a subsequence lies in [brk[lo], brk[hi+1]) of its segment, and the
+/// squared distance to an interval is convex, so the segment costs at least its width times
+/// the squared gap between that range and the segment envelope of the query (LB_PAA).
+double lb_node(const Node *nd, Query *Q, int m)
+{
+    double lb = 0;
+    for (int d = 0; d < 2; d++)
+        for (int s = 0; s < SEGMENTS; s++)
+        {
+            int w = seg_start(s+1, m) - seg_start(s, m);
+            /// a small margin for rounding of the PAA values near a breakpoint
+            double a = brk[nd->lo[d*SEGMENTS+s]] - 1e-9;
+            double b = brk[nd->hi[d*SEGMENTS+s]+1] + 1e-9;
+            double g = 0;
+            if (Q[d].pl[s] > b)
+                g = Q[d].pl[s] - b;
+            else if (Q[d].pu[s] < a)
+                g = a - Q[d].pu[s];
+            lb += w*g*g;
+        }
+    return lb;
+}
+
+/// Work arrays and statistics of the cascade
+typedef struct Cascade
+    {   double *tz[2], *cb[2], *cb1[2], *cb2[2], *l[2], *u[2];
+        long long kim, keogh, keogh2, dtwc, flat;
+    } Cascade;
+
+/// The cascade of UCR_DTW for one subsequence: LB_Kim, LB_Keogh, LB_Keogh on the data envelope,
+/// then DTW with early abandoning. Both dimensions add up to the distance.
+/// Returns the distance, or a value >= bsf when the subsequence cannot beat bsf.
+double evaluate(double *t[2], Query *Q, int m, int r, Cascade *C, double bsf, double *dd)
+{
+    double mean[2], std[2], lb_kim[2], lb_k[2], lb_k2[2], ds[2];
+    int d, k;
+
+    for (d = 0; d < 2; d++)
+    {
+        double ex = 0, ex2 = 0;
+        for (k = 0; k < m; k++)
+        {   ex += t[d][k];
+            ex2 += t[d][k]*t[d][k];
+        }
+        mean[d] = ex/m;
+        std[d] = ex2/m - mean[d]*mean[d];
+        if (!(std[d] > 0))
+        {   C->flat++;
+            return INF;
+        }
+        std[d] = sqrt(std[d]);
+    }
+
+    lb_kim[0] = lb_kim_hierarchy(t[0], Q[0].q, 0, m, mean[0], std[0], bsf);
+    lb_kim[1] = lb_kim_hierarchy(t[1], Q[1].q, 0, m, mean[1], std[1], bsf - lb_kim[0]);
+    if (lb_kim[0] + lb_kim[1] >= bsf)
+    {   C->kim++;
+        return lb_kim[0] + lb_kim[1];
+    }
+
+    lb_k[0] = lb_keogh_cumulative(Q[0].order, t[0], Q[0].uo, Q[0].lo, C->cb1[0], 0, m, mean[0], std[0], bsf);
+    lb_k[1] = lb_keogh_cumulative(Q[1].order, t[1], Q[1].uo, Q[1].lo, C->cb1[1], 0, m, mean[1], std[1], bsf - lb_k[0]);
+    if (lb_k[0] + lb_k[1] >= bsf)
+    {   C->keogh++;
+        return lb_k[0] + lb_k[1];
+    }
+
+    /// The data envelope is built over the subsequence itself, already z-normalized
+    for (d = 0; d < 2; d++)
+    {
+        for (k = 0; k < m; k++)
+            C->tz[d][k] = (t[d][k] - mean[d])/std[d];
+        lower_upper_lemire(C->tz[d], m, r, C->l[d], C->u[d]);
+    }
+    lb_k2[0] = lb_keogh_data_cumulative(Q[0].order, C->tz[0], Q[0].qo, C->cb2[0], C->l[0], C->u[0], m, 0, 1, bsf);
+    lb_k2[1] = lb_keogh_data_cumulative(Q[1].order, C->tz[1], Q[1].qo, C->cb2[1], C->l[1], C->u[1], m, 0, 1, bsf - lb_k2[0]);
+    if (lb_k2[0] + lb_k2[1] >= bsf)
+    {   C->keogh2++;
+        return lb_k2[0] + lb_k2[1];
+    }
+
+    for (d = 0; d < 2; d++)
+    {
+        double *c = lb_k[d] > lb_k2[d] ? C->cb1[d] : C->cb2[d];
+        C->cb[d][m-1] = c[m-1];
+        for (k = m-2; k >= 0; k--)
+            C->cb[d][k] = C->cb[d][k+1] + c[k];
+    }
+    C->dtwc++;
+    double lbA = max(lb_k[1], lb_k2[1]);
+    ds[0] = dtw(C->tz[0], Q[0].q, C->cb[0], m, r, bsf - lbA);
+    if (ds[0] + lbA >= bsf)
+        return ds[0] + lbA;
+    ds[1] = dtw(C->tz[1], Q[1].q, C->cb[1], m, r, bsf - ds[0]);
+    dd[0] = ds[0];
+    dd[1] = ds[1];
+    return ds[0] + ds[1];
+}
+
+/// Search the index.
+/// Leaves and nodes are kept in one priority queue by lower bound. Approximate search stops after
+/// the given number of leaves; exact search stops when the best lower bound left reaches bsf.
+void search(const char *data_file, const char *index_file, const char *query_file, double R,
+            int max_leaves, bool exact)
+{
+    FILE *fp, *ip, *qp;
+    BlockHeader bh;
+    IsaxHeader h;
+    Node *leaves, *nodes;
+    Query Q[2];
+    Cascade C;
+    double *q[2], *t[2], *bx, *by;
+    double bsf = INF, bsfd[2] = { INF, INF }, dd[2];
+    long long loc = -1, cached = -1, visited = 0, checked = 0, expanded = 0;
+    int m, r, d, k;
+    double d0, d1;
+    double t1 = clock(), t2;
+
+    fp = fopen(data_file, "rb");
+    ip = fopen(index_file, "rb");
+    qp = fopen(query_file, "r");
+    if (fp == NULL || ip == NULL || qp == NULL)
+        error(2);
+    if (!block_read_header(fp, &bh))
+        error(5);
+    if (fread(&h, sizeof(h), 1, ip) != 1 || memcmp(h.magic, ISAX_MAGIC, sizeof(ISAX_MAGIC)) != 0 ||
+        h.version != ISAX_VERSION || h.n != bh.n)
+        error(5);
+    m = h.m;
+    r = R <= 1 ? (int)floor(R*m) : (int)floor(R);
+
+    /// The directory of leaves and nodes is small and kept in memory
+    leaves = (Node *)malloc(sizeof(Node)*max(1LL, h.nleaves));
+    nodes = (Node *)malloc(sizeof(Node)*max(1LL, h.nnodes));
+    if (leaves == NULL || nodes == NULL)
+        error(1);
+    if (fseeko(ip, (off_t)h.leaf_offset, SEEK_SET) != 0 ||
+        fread(leaves, sizeof(Node), h.nleaves, ip) != (size_t)h.nleaves ||
+        fseeko(ip, (off_t)h.node_offset, SEEK_SET) != 0 ||
+        fread(nodes, sizeof(Node), h.nnodes, ip) != (size_t)h.nnodes)
+        error(5);
+
+    for (d = 0; d < 2; d++)
+    {
+        q[d] = (double *)malloc(sizeof(double)*m);
+        t[d] = (double *)malloc(sizeof(double)*m);
+        C.tz[d] = (double *)malloc(sizeof(double)*m);
+        C.cb[d] = (double *)malloc(sizeof(double)*m);
+        C.cb1[d] = (double *)malloc(sizeof(double)*m);
+        C.cb2[d] = (double *)malloc(sizeof(double)*m);
+        C.l[d] = (double *)malloc(sizeof(double)*m);
+        C.u[d] = (double *)malloc(sizeof(double)*m);
+        if (q[d] == NULL || t[d] == NULL || C.tz[d] == NULL || C.cb[d] == NULL ||
+            C.cb1[d] == NULL || C.cb2[d] == NULL || C.l[d] == NULL || C.u[d] == NULL)
+            error(1);
+    }
+    C.kim = C.keogh = C.keogh2 = C.dtwc = C.flat = 0;
+    bx = (double *)malloc(sizeof(double)*bh.block_size);
+    by = (double *)malloc(sizeof(double)*bh.block_size);
+    long long *pos = (long long *)malloc(sizeof(long long)*h.leaf_size);
+    if (bx == NULL || by == NULL || pos == NULL)
+        error(1);
+
+    for (k = 0; k < m && fscanf(qp, "%lf %lf", &d0, &d1) == 2; k++)
+    {   q[0][k] = d0;
+        q[1][k] = d1;
+    }
+    fclose(qp);
+    if (k < m)
+        error(5);
+    prepare_query(q[0], m, r, &Q[0]);
+    prepare_query(q[1], m, r, &Q[1]);
+
+    /// (lower bound, id); ids below nnodes are nodes, the others leaves
+    typedef std::pair<double, long long> Item;
+    std::priority_queue< Item, std::vector<Item>, std::greater<Item> > pq;
+    for (long long i = 0; i < h.nnodes; i++)
+        pq.push(Item(lb_node(&nodes[i], Q, m), i));
+
+    while (!pq.empty())
+    {
+        Item it = pq.top();
+        if (it.first >= bsf)
+            break;
+        if (!exact && visited >= max_leaves)
+            break;
+        pq.pop();
+
+        if (it.second < h.nnodes)
+        {
+            Node *nd = &nodes[it.second];
+            for (long long l = nd->first; l < nd->first + nd->count; l++)
+            {
+                double lb = lb_node(&leaves[l], Q, m);
+                if (lb < bsf)
+                    pq.push(Item(lb, h.nnodes + l));
+            }
+            expanded++;
+            continue;
+        }
+
+        /// Check every subsequence of the leaf, in file order for the block reads
+        Node *lf = &leaves[it.second - h.nnodes];
+        if (fseeko(ip, (off_t)(sizeof(IsaxHeader) + lf->first*sizeof(long long)), SEEK_SET) != 0 ||
+            fread(pos, sizeof(long long), lf->count, ip) != (size_t)lf->count)
+            error(5);
+        qsort(pos, lf->count, sizeof(long long), comp_position);
+        for (k = 0; k < lf->count; k++)
+        {
+            if (!block_read_window(fp, &bh, pos[k], m, t[0], t[1], bx, by, &cached))
+                error(5);
+            double dist = evaluate(t, Q, m, r, &C, bsf, dd);
+            if (dist < bsf)
+            {
+                bsf = dist;
+                bsfd[0] = dd[0];
+                bsfd[1] = dd[1];
+                loc = pos[k];
+            }
+        }
+        checked += lf->count;
+        visited++;
+    }
+    fclose(fp);
+    fclose(ip);
+    t2 = clock();
+
+    cout << "Location : " << loc << endl;
+    cout << "Distance : " << sqrt(bsf) << endl;
+    cout << "Distance(1) : " << sqrt(bsfd[0]) << endl;
+    cout << "Distance(2) : " << sqrt(bsfd[1]) << endl;
+    cout << "Leaves Visited : " << visited << " of " << h.nleaves << endl;
+    cout << "Subsequences Checked : " << checked << " of " << h.entries << endl;
+    cout << "Total Execution Time : " << (t2-t1)/CLOCKS_PER_SEC << " sec" << endl;
+    if (exact)
+    {
+        printf("\n");
+        printf("Pruned by Index     : %6.7f%%\n", 100 - ((double) checked / max(1LL, h.entries))*100);
+        printf("Pruned by LB_Kim    : %6.7f%%\n", ((double) C.kim / max(1LL, h.entries))*100);
+        printf("Pruned by LB_Keogh  : %6.7f%%\n", ((double) C.keogh / max(1LL, h.entries))*100);
+        printf("Pruned by LB_Keogh2 : %6.7f%%\n", ((double) C.keogh2 / max(1LL, h.entries))*100);
+        printf("DTW Calculation     : %6.7f%%\n", ((double) C.dtwc / max(1LL, h.entries))*100);
+        printf("Nodes pruned        : %lld of %lld\n", h.nnodes - expanded, h.nnodes);
+        printf("Leaves pruned       : %lld of %lld\n", h.nleaves - visited, h.nleaves);
+    }
+
+    for (d = 0; d < 2; d++)
+    {
+        free(q[d]); free(t[d]);
+        free(C.tz[d]); free(C.cb[d]); free(C.cb1[d]); free(C.cb2[d]); free(C.l[d]); free(C.u[d]);
+        free(Q[d].qo); free(Q[d].uo); free(Q[d].lo); free(Q[d].order); free(Q[d].pl); free(Q[d].pu);
+    }
+    free(leaves);
+    free(nodes);
+    free(bx);
+    free(by);
+    free(pos);
+}
+
+int main(  int argc , char *argv[] )
+{
+    double t1, t2;
+
+    if (argc <= 4)
+        error(4);
+    init_breakpoints();
+
+    if (strcmp(argv[1], "build") == 0)
+    {
+        int leaf_size = argc > 5 ? atoi(argv[5]) : 1024;
+        if (leaf_size <= 0)
+            error(4);
+        t1 = clock();
+        build(argv[2], argv[3], atoi(argv[4]), leaf_size);
+        t2 = clock();
+        cout << "Total Execution Time : " << (t2-t1)/CLOCKS_PER_SEC << " sec" << endl;
+    }
+    else if (strcmp(argv[1], "search") == 0 && argc > 5)
+    {
+        int max_leaves = 4;
+        bool exact = false;
+        for (int a = 6; a < argc; a++)
+        {
+            if (strcmp(argv[a], "-exact") == 0)
+                exact = true;
+            else if (strcmp(argv[a], "-l") == 0 && a+1 < argc)
+                max_leaves = atoi(argv[++a]);
+            else
+                error(4);
+        }
+        search(argv[2], argv[3], argv[4], atof(argv[5]), max_leaves, exact);
+    }
+    else
+        error(4);
+    return 0;
+}
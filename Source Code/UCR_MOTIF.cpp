@@ -0,0 +1,545 @@
+/***********************************************************************/
+/** UCR_MOTIF: DTW self-join of a 2-dimensional series.               **/
+/**                                                                   **/
+/** For every subsequence of length m it finds the nearest other      **/
+/** subsequence under the same distance as UCR_DTW (DTW of both       **/
+/** z-normalized dimensions added up), leaving out trivial matches    **/
+/** that overlap it by more than m-excl points. The result is a DTW   **/
+/** matrix profile and the top motifs, the closest pairs.             **/
+/**                                                                   **/
+/** Each pair (i,j) is checked once and updates the profile of both,  **/
+/** with the UCR_DTW cascade: LB_Kim, LB_Keogh with the envelope of i,**/
+/** LB_Keogh with the envelope of j, then DTW with early abandoning.  **/
+/** A pair is abandoned once it can improve neither of the two. The   **/
+/** rows are cut into blocks shared out to the threads, and a thread  **/
+/** that runs out of blocks steals half of the rest of another one.   **/
+/***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "ucr_block.h"
+#include "ucr_dtw.h"
+
+using namespace std;
+
+#define ROWS    16                  /// rows per block of work
+#define LOCKS   4096                /// locks over the profile entries
+
+/// The whole series with its running statistics and envelopes
+typedef struct Series
+    {   double    *x[2];            /// both dimensions
+        double    *l[2], *u[2];     /// envelope of the raw data for warping window r
+        double    *mean[2], *std[2];/// of the subsequence starting at each point
+        long long  n, s;            /// points and subsequences
+        int        m, r, excl;
+        Kernels    K;               /// DTW for this m and r
+    } Series;
+
+/// Matrix profile: distance to the nearest neighbour and its location
+typedef struct Profile
+    {   atomic<double> *d;
+        long long      *nn;
+        mutex          *lock;
+    } Profile;
+
+/// Rows [lo,hi) of blocks still to do for one thread; others may take from the top
+typedef struct Queue
+    {   long long lo, hi;
+        mutex     lock;
+    } Queue;
+
+/// Work arrays of one thread and its counters
+typedef struct Worker
+    {   double    *q[2], *l[2], *u[2], *tz[2];
+        double    *cb[2], *cb1[2], *cb2[2];
+        SortedPoint *so[2];         /// the query in sorted order with its envelope
+        int       *order;
+        long long  kim, keogh, keogh2, dtwc, pairs;
+    } Worker;
+
+/// If serious error happens, terminate the program.
+void error(int id)
+{
+    if(id==1)
+        printf("ERROR : Memory can't be allocated!!!\n\n");
+    else if ( id == 2 )
+        printf("ERROR : File not Found!!!\n\n");
+    else if ( id == 3 )
+        printf("ERROR : Can't create Output File!!!\n\n");
+    else if ( id == 4 )
+    {
+        printf("ERROR: Invalid Number of Arguments!!!\n");
+        printf("Command Usage:   UCR_MOTIF.exe  data_file  m  R  [-t threads] [-k motifs] [-excl E] [-o profile_file]\n");
+        printf("For example  :   UCR_MOTIF.exe  data.blk   128  0.05  -t 8  -k 3  -o profile.txt\n");
+    }
+    exit(1);
+}
+
+/// Read a text or block file into memory
+void load(const char *name, Series *S)
+{
+    FILE *fp = fopen(name, "rb");
+    BlockHeader h;
+    long long cap;
+    double d, dA;
+
+    if (fp == NULL)
+        error(2);
+    if (block_read_header(fp, &h))
+    {
+        S->n = h.n;
+        S->x[0] = (double *)malloc(sizeof(double)*(h.n+1));
+        S->x[1] = (double *)malloc(sizeof(double)*(h.n+1));
+        if (S->x[0] == NULL || S->x[1] == NULL)
+            error(1);
+        for (long long b = 0; b < h.nblocks; b++)
+            if (block_read(fp, &h, b, S->x[0] + b*h.block_size, S->x[1] + b*h.block_size) == 0)
+                error(2);
+    }
+    else
+    {
+        rewind(fp);
+        cap = 1<<20;
+        S->n = 0;
+        S->x[0] = (double *)malloc(sizeof(double)*cap);
+        S->x[1] = (double *)malloc(sizeof(double)*cap);
+        while (fscanf(fp, "%lf\t%lf", &d, &dA) == 2)
+        {
+            if (S->n == cap)
+            {   cap *= 2;
+                S->x[0] = (double *)realloc(S->x[0], sizeof(double)*cap);
+                S->x[1] = (double *)realloc(S->x[1], sizeof(double)*cap);
+            }
+            if (S->x[0] == NULL || S->x[1] == NULL)
+                error(1);
+            S->x[0][S->n] = d;
+            S->x[1][S->n] = dA;
+            S->n++;
+        }
+    }
+    fclose(fp);
+}
+
+/// Mean and standard deviation of every subsequence, and the envelope of the whole series.
+/// The envelope of the data around j, shifted and scaled, contains the envelope of the
+/// z-normalized subsequence at j, so LB_Keogh with it is still a lower bound.
+void prepare(Series *S)
+{
+    int m = S->m;
+    S->s = S->n - m + 1;
+    for (int k = 0; k < 2; k++)
+    {
+        double *x = S->x[k];
+        long double ex = 0, ex2 = 0;
+        S->mean[k] = (double *)malloc(sizeof(double)*S->s);
+        S->std[k] = (double *)malloc(sizeof(double)*S->s);
+        S->l[k] = (double *)malloc(sizeof(double)*S->n);
+        S->u[k] = (double *)malloc(sizeof(double)*S->n);
+        if (S->mean[k] == NULL || S->std[k] == NULL || S->l[k] == NULL || S->u[k] == NULL)
+            error(1);
+        for (long long i = 0; i < S->n; i++)
+        {
+            ex += x[i];
+            ex2 += x[i]*x[i];
+            if (i >= m-1)
+            {
+                long long p = i-m+1;
+                double mean = (double)(ex/m);
+                double var = (double)(ex2/m) - mean*mean;
+                S->mean[k][p] = mean;
+                S->std[k][p] = var > 0 ? sqrt(var) : 0;
+                ex -= x[p];
+                ex2 -= x[p]*x[p];
+            }
+        }
+        lower_upper_lemire(x, (int)S->n, S->r, S->l[k], S->u[k]);
+    }
+}
+
+/// Lower the profile of i to d with neighbour j, if that is better
+static inline void update(Profile *P, long long i, long long j, double d)
+{
+    if (d >= P->d[i].load(memory_order_relaxed))
+        return;
+    lock_guard<mutex> g(P->lock[i % LOCKS]);
+    if (d < P->d[i].load(memory_order_relaxed))
+    {   P->d[i].store(d, memory_order_relaxed);
+        P->nn[i] = j;
+    }
+}
+
+/// Prepare subsequence i as the query: z-normalized, sorted, with its own envelope
+void set_query(Series *S, Worker *W, long long i)
+{
+    int m = S->m;
+    for (int k = 0; k < 2; k++)
+    {
+        double mean = S->mean[k][i], std = S->std[k][i];
+        for (int a = 0; a < m; a++)
+            W->q[k][a] = (S->x[k][i+a] - mean)/std;
+        lower_upper_lemire(W->q[k], m, S->r, W->l[k], W->u[k]);
+        query_order(W->q[k], m, W->order, 1);
+        for (int a = 0; a < m; a++)
+        {   int o = W->order[a];
+            W->so[k][a].order = o;
+            W->so[k][a].qo = W->q[k][o];
+            W->so[k][a].uo = W->u[k][o];
+            W->so[k][a].lo = W->l[k][o];
+        }
+    }
+}
+
+/// Distance of the pair (i,j), with i the query prepared by set_query; INF once it reaches bsf.
+/// The same cascade as UCR_DTW, where the second dimension gets what the first left of bsf.
+double pair_dtw(Series *S, Worker *W, long long j, double bsf)
+{
+    int m = S->m, r = S->r, k;
+    double *t[2] = { S->x[0]+j, S->x[1]+j };
+    double mean[2] = { S->mean[0][j], S->mean[1][j] };
+    double std[2] = { S->std[0][j], S->std[1][j] };
+    double lb_kim, lb_kimA, lb_k, lb_kA, lb_k2, lb_k2A, dist, distA;
+
+    W->pairs++;
+    lb_kim = lb_kim_hierarchy(t[0], W->q[0], 0, m, mean[0], std[0], bsf);
+    lb_kimA = lb_kim < bsf ? lb_kim_hierarchy(t[1], W->q[1], 0, m, mean[1], std[1], bsf - lb_kim) : INF;
+    if (!(lb_kim + lb_kimA < bsf))
+    {   W->kim++;
+        return INF;
+    }
+
+    /// LB_Keogh with the envelope of the query i
+    lb_k = lb_keogh_sorted(W->so[0], t[0], W->cb1[0], 0, m, mean[0], std[0], bsf);
+    lb_kA = lb_k < bsf ? lb_keogh_sorted(W->so[1], t[1], W->cb1[1], 0, m, mean[1], std[1], bsf - lb_k) : INF;
+    if (!(lb_k + lb_kA < bsf))
+    {   W->keogh++;
+        return INF;
+    }
+
+    /// LB_Keogh with the envelope of the data at j
+    for (k = 0; k < m; k++)
+    {   W->tz[0][k] = (t[0][k] - mean[0])/std[0];
+        W->tz[1][k] = (t[1][k] - mean[1])/std[1];
+    }
+    lb_k2 = lb_keogh_data_sorted(W->so[0], W->cb2[0], S->l[0]+j, S->u[0]+j, m, mean[0], std[0], bsf);
+    lb_k2A = lb_k2 < bsf ? lb_keogh_data_sorted(W->so[1], W->cb2[1], S->l[1]+j, S->u[1]+j, m, mean[1], std[1], bsf - lb_k2) : INF;
+    if (!(lb_k2 + lb_k2A < bsf))
+    {   W->keogh2++;
+        return INF;
+    }
+
+    /// The better bound of each dimension, cumulated from the end, for early abandoning
+    for (int d = 0; d < 2; d++)
+    {
+        double *c = (d == 0 ? lb_k > lb_k2 : lb_kA > lb_k2A) ? W->cb1[d] : W->cb2[d];
+        W->cb[d][m-1] = c[m-1];
+        for (k = m-2; k >= 0; k--)
+            W->cb[d][k] = W->cb[d][k+1] + c[k];
+    }
+
+    double lbA = max(lb_kA, lb_k2A);
+    W->dtwc++;
+    dist = S->K.dtw(W->tz[0], W->q[0], W->cb[0], m, r, bsf - lbA);
+    if (!(dist + lbA < bsf))
+        return INF;
+    distA = S->K.dtw(W->tz[1], W->q[1], W->cb[1], m, r, bsf - dist);
+    return dist + distA < bsf ? dist + distA : INF;
+}
+
+/// One row: pairs (i,j) for all j at least excl after i
+void row(Series *S, Profile *P, Worker *W, long long i)
+{
+    if (S->std[0][i] == 0 || S->std[1][i] == 0)
+        return;
+    set_query(S, W, i);
+    for (long long j = i + S->excl; j < S->s; j++)
+    {
+        if (S->std[0][j] == 0 || S->std[1][j] == 0)
+            continue;
+        /// The pair is only of use while it can improve one of the two
+        double bsf = max(P->d[i].load(memory_order_relaxed), P->d[j].load(memory_order_relaxed));
+        double d = pair_dtw(S, W, j, bsf);
+        if (d < INF)
+        {   update(P, i, j, d);
+            update(P, j, i, d);
+        }
+    }
+}
+
+/// Take the next block of rows, own ones from the bottom, else half of the largest
+/// rest of another thread from the top. Returns -1 when all work is done.
+long long next_block(Queue *Qs, int nt, int me)
+{
+    {
+        lock_guard<mutex> g(Qs[me].lock);
+        if (Qs[me].lo < Qs[me].hi)
+            return Qs[me].lo++;
+    }
+    while (true)
+    {
+        int v = -1;
+        long long most = 0;
+        for (int k = 0; k < nt; k++)
+        {
+            lock_guard<mutex> g(Qs[k].lock);
+            if (Qs[k].hi - Qs[k].lo > most)
+            {   most = Qs[k].hi - Qs[k].lo;
+                v = k;
+            }
+        }
+        if (v < 0)
+            return -1;
+        long long a, b;
+        {
+            lock_guard<mutex> g(Qs[v].lock);
+            if (Qs[v].hi - Qs[v].lo < 1)
+                continue;
+            b = Qs[v].hi;
+            a = b - (Qs[v].hi - Qs[v].lo + 1)/2;
+            Qs[v].hi = a;
+        }
+        lock_guard<mutex> g(Qs[me].lock);
+        Qs[me].lo = a+1;
+        Qs[me].hi = b;
+        return a;
+    }
+}
+
+void worker_init(Worker *W, int m)
+{
+    memset(W, 0, sizeof(Worker));
+    for (int k = 0; k < 2; k++)
+    {
+        double **a[] = { &W->q[k], &W->l[k], &W->u[k], &W->tz[k], &W->cb[k], &W->cb1[k], &W->cb2[k] };
+        for (int x = 0; x < 7; x++)
+        {   *a[x] = (double *)calloc(m, sizeof(double));
+            if (*a[x] == NULL)
+                error(1);
+        }
+        W->so[k] = (SortedPoint *)malloc(sizeof(SortedPoint)*m);
+        if (W->so[k] == NULL)
+            error(1);
+    }
+    W->order = (int *)malloc(sizeof(int)*m);
+    if (W->order == NULL)
+        error(1);
+}
+
+void worker_free(Worker *W)
+{
+    for (int k = 0; k < 2; k++)
+    {
+        free(W->q[k]);  free(W->l[k]);  free(W->u[k]);  free(W->tz[k]);
+        free(W->cb[k]);  free(W->cb1[k]);  free(W->cb2[k]);
+        free(W->so[k]);
+    }
+    free(W->order);
+}
+
+void work(Series *S, Profile *P, Queue *Qs, int nt, int me, Worker *W)
+{
+    long long b;
+    while ((b = next_block(Qs, nt, me)) >= 0)
+        for (long long i = b*ROWS; i < min((b+1)*ROWS, S->s); i++)
+            row(S, P, W, i);
+}
+
+/// Seed the profile with the pairs (i, i+s/2), so the first rows have a bound to prune with
+void seed(Series *S, Profile *P, Worker *W, long long from, long long to)
+{
+    long long h = S->s/2;
+    for (long long i = from; i < to && h >= S->excl; i++)
+    {
+        if (S->std[0][i] == 0 || S->std[1][i] == 0 || S->std[0][i+h] == 0 || S->std[1][i+h] == 0)
+            continue;
+        set_query(S, W, i);
+        double d = pair_dtw(S, W, i+h, INF);
+        update(P, i, i+h, d);
+        update(P, i+h, i, d);
+    }
+}
+
+/// The current neighbour of i, -1 if none yet
+static long long neighbour(Profile *P, long long i)
+{
+    lock_guard<mutex> g(P->lock[i % LOCKS]);
+    return P->nn[i];
+}
+
+/// Try the pair (i,j) against the profiles of both, as long as it is no trivial match
+static void try_pair(Series *S, Profile *P, Worker *W, long long i, long long j)
+{
+    if (j < 0 || j >= S->s || llabs(i-j) < S->excl || S->std[0][j] == 0 || S->std[1][j] == 0)
+        return;
+    double bsf = max(P->d[i].load(memory_order_relaxed), P->d[j].load(memory_order_relaxed));
+    double d = pair_dtw(S, W, j, bsf);
+    if (d < INF)
+    {   update(P, i, j, d);
+        update(P, j, i, d);
+    }
+}
+
+/// Neighbours of neighbours: if j is close to i, j+1 is likely close to i+1.
+/// A forward and a backward pass carry good pairs along their diagonals.
+void propagate(Series *S, Profile *P, Worker *W, long long from, long long to)
+{
+    for (long long i = max(from, 1LL); i < to; i++)
+        if (S->std[0][i] != 0 && S->std[1][i] != 0 && neighbour(P, i-1) >= 0)
+        {   set_query(S, W, i);
+            try_pair(S, P, W, i, neighbour(P, i-1)+1);
+        }
+    for (long long i = min(to, S->s-1) - 1; i >= from; i--)
+        if (S->std[0][i] != 0 && S->std[1][i] != 0 && neighbour(P, i+1) >= 0)
+        {   set_query(S, W, i);
+            try_pair(S, P, W, i, neighbour(P, i+1)-1);
+        }
+}
+
+int main(  int argc , char *argv[] )
+{
+    Series S;
+    Profile P;
+    int nt = thread::hardware_concurrency(), top = 3, k;
+    const char *out = NULL;
+    double R;
+
+    if (argc < 4)
+        error(4);
+    memset(&S, 0, sizeof(S));
+    S.m = atoi(argv[2]);
+    R = atof(argv[3]);
+    S.r = R <= 1 ? (int)floor(R*S.m) : (int)floor(R);
+    S.excl = (S.m+3)/4;
+    for (int a = 4; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-t") == 0 && a+1 < argc)
+            nt = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-k") == 0 && a+1 < argc)
+            top = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-excl") == 0 && a+1 < argc)
+            S.excl = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-o") == 0 && a+1 < argc)
+            out = argv[++a];
+        else
+            error(4);
+    }
+    if (S.m < 2 || nt < 1 || S.excl < 1)
+        error(4);
+    S.K = kernels_select(S.m, S.r);
+
+    auto w1 = chrono::steady_clock::now();
+    load(argv[1], &S);
+    if (S.n < S.m)
+        error(4);
+    prepare(&S);
+
+    P.d = new atomic<double>[S.s];
+    P.nn = (long long *)malloc(sizeof(long long)*S.s);
+    P.lock = new mutex[LOCKS];
+    if (P.nn == NULL)
+        error(1);
+    for (long long i = 0; i < S.s; i++)
+    {   P.d[i].store(INF);
+        P.nn[i] = -1;
+    }
+
+    vector<Worker> W(nt);
+    vector<thread> th;
+    for (k = 0; k < nt; k++)
+        worker_init(&W[k], S.m);
+
+    /// Seed pass, split evenly
+    long long h = S.s/2;
+    for (k = 0; k < nt; k++)
+        th.push_back(thread(seed, &S, &P, &W[k], h*k/nt, h*(k+1)/nt));
+    for (k = 0; k < nt; k++)
+        th[k].join();
+    th.clear();
+    for (k = 0; k < nt; k++)
+        th.push_back(thread(propagate, &S, &P, &W[k], S.s*k/nt, S.s*(k+1)/nt));
+    for (k = 0; k < nt; k++)
+        th[k].join();
+    th.clear();
+
+    /// Self-join: every thread starts with an equal share of the row blocks
+    long long nb = (S.s + ROWS-1)/ROWS;
+    Queue *Qs = new Queue[nt];
+    for (k = 0; k < nt; k++)
+    {   Qs[k].lo = nb*k/nt;
+        Qs[k].hi = nb*(k+1)/nt;
+    }
+    for (k = 0; k < nt; k++)
+        th.push_back(thread(work, &S, &P, Qs, nt, k, &W[k]));
+    for (k = 0; k < nt; k++)
+        th[k].join();
+    auto w2 = chrono::steady_clock::now();
+
+    /// Motifs: the closest pairs, leaving out those near an earlier motif
+    vector<long long> idx;
+    vector<long long> taken;
+    for (long long i = 0; i < S.s; i++)
+        if (P.d[i].load() < INF)
+            idx.push_back(i);
+    std::sort(idx.begin(), idx.end(), [&](long long a, long long b) { return P.d[a].load() < P.d[b].load(); });
+    int found = 0;
+    for (size_t x = 0; x < idx.size() && found < top; x++)
+    {
+        long long a = idx[x], b = P.nn[a];
+        bool near = false;
+        for (size_t y = 0; y < taken.size() && !near; y++)
+            near = llabs(taken[y]-a) < S.m || llabs(taken[y]-b) < S.m;
+        if (near)
+            continue;
+        taken.push_back(a);
+        taken.push_back(b);
+        found++;
+        cout << "Motif " << found << " : " << a << " and " << b << ", Distance " << sqrt(P.d[a].load()) << endl;
+    }
+
+    if (out != NULL)
+    {
+        FILE *fo = fopen(out, "w");
+        if (fo == NULL)
+            error(3);
+        for (long long i = 0; i < S.s; i++)
+            fprintf(fo, "%.10g\t%lld\n", P.d[i].load() < INF ? sqrt(P.d[i].load()) : -1.0, P.nn[i]);
+        fclose(fo);
+    }
+
+    long long kim = 0, keogh = 0, keogh2 = 0, dtwc = 0, pairs = 0;
+    for (k = 0; k < nt; k++)
+    {   kim += W[k].kim;
+        keogh += W[k].keogh;
+        keogh2 += W[k].keogh2;
+        dtwc += W[k].dtwc;
+        pairs += W[k].pairs;
+        worker_free(&W[k]);
+    }
+    cout << "Subsequences : " << S.s << ", exclusion zone " << S.excl << endl;
+    cout << "Pairs : " << pairs << endl;
+    cout << "Threads : " << nt << endl;
+    cout << "Total Execution Time : " << chrono::duration<double>(w2-w1).count() << " sec" << endl;
+    printf("\n");
+    printf("Pruned by LB_Kim    : %6.7f%%\n", ((double) kim / pairs)*100);
+    printf("Pruned by LB_Keogh  : %6.7f%%\n", ((double) keogh / pairs)*100);
+    printf("Pruned by LB_Keogh2 : %6.7f%%\n", ((double) keogh2 / pairs)*100);
+    printf("DTW Calculation     : %6.7f%%\n", ((double) dtwc / pairs)*100);
+
+    delete[] P.d;
+    delete[] P.lock;
+    delete[] Qs;
+    free(P.nn);
+    for (k = 0; k < 2; k++)
+    {   free(S.x[k]);  free(S.l[k]);  free(S.u[k]);
+        free(S.mean[k]);  free(S.std[k]);
+    }
+    return 0;
+}
@@ -0,0 +1,220 @@
+/***********************************************************************/
+/** UCR_PACK: convert a two-column text series into a block file.     **/
+/**                                                                   **/
+/** The block file keeps the data in binary form together with a      **/
+/** per-block summary (min, max, sum, sum of squares per dimension)   **/
+/** which UCR_DTW uses to skip blocks that cannot contain a match.    **/
+/** See ucr_block.h for the layout. With -q the data is quantized to  **/
+/** int16 codes with a scale and offset per block, with -z it is      **/
+/** compressed without loss.                                          **/
+/***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <iostream>
+#include "ucr_block.h"
+
+using namespace std;
+
+/// If serious error happens, terminate the program.
+void error(int id)
+{
+    if(id==1)
+        printf("ERROR : Memory can't be allocated!!!\n\n");
+    else if ( id == 2 )
+        printf("ERROR : File not Found!!!\n\n");
+    else if ( id == 3 )
+        printf("ERROR : Can't create Output File!!!\n\n");
+    else if ( id == 4 )
+    {
+        printf("ERROR: Invalid Number of Arguments!!!\n");
+        printf("Command Usage:   UCR_PACK.exe  text_file  block_file  [block_size]  [-q | -z]\n");
+        printf("For example  :   UCR_PACK.exe  data.txt   data.blk    64  -q\n");
+    }
+    exit(1);
+}
+
+/// Write one block and append its summary.
+/// A quantized block is written as codes, followed by the residual of each lossy dimension.
+/// A packed block is written as two packed dimensions. words is work space for both.
+void write_block(FILE *out, bool quant, double *x, double *y, int c, BlockSummary *s,
+                 int16_t *code, double *err, uint64_t *words)
+{
+    if (quant)
+    {
+        BlockQuant bq;
+        uint64_t *rec = words, *work = words+QUANT_WORDS+c+2*(2+c);
+        double *q = (double *)(work+c);
+        double *v[2] = { x, y };
+        block_quantize(x, c, &bq, 0, code);
+        block_quantize(y, c, &bq, 1, code+c);
+        memcpy(rec, &bq, sizeof(bq));
+        memset(quant_codes(rec), 0, (quant_residual(rec, c) - rec - QUANT_WORDS)*sizeof(uint64_t));
+        memcpy(quant_codes(rec), code, sizeof(int16_t)*2*c);
+        uint64_t *res = quant_residual(rec, c);
+        for (int d = 0; d < 2; d++)
+            if (bq.err[d] > 0)
+            {   for (int i = 0; i < c; i++)
+                    q[i] = bq.offset[d] + bq.scale[d]*code[d*c+i];
+                res += block_residual(v[d], q, c, res, work);
+            }
+        if (fwrite(rec, sizeof(uint64_t), res-rec, out) != (size_t)(res-rec))
+            error(3);
+        if (bq.err[0] > err[0]) err[0] = bq.err[0];
+        if (bq.err[1] > err[1]) err[1] = bq.err[1];
+    }
+    else if (words != NULL)
+    {
+        int n = block_pack(x, c, words, words+2*(2+c));
+        n += block_pack(y, c, words+n, words+2*(2+c));
+        if (fwrite(words, sizeof(uint64_t), n, out) != (size_t)n)
+            error(3);
+    }
+    else
+    {
+        if (fwrite(x, sizeof(double), c, out) != (size_t)c ||
+            fwrite(y, sizeof(double), c, out) != (size_t)c)
+            error(3);
+    }
+    block_summarize(x, y, c, s);
+}
+
+int main(  int argc , char *argv[] )
+{
+    FILE *fp;              // the input text file
+    FILE *out;             // the output block file
+    BlockHeader h;
+    BlockSummary *sum;     // summaries of all blocks written so far
+    long long cap;         // capacity of sum
+    double *x, *y;         // current block
+    int16_t *code;         // codes of the current block
+    uint64_t *words = NULL;   // words of the current block, with -q or -z
+    long long *dir;        // offsets of the packed blocks
+    bool packed = false, quant = false;
+    double err[2] = {0, 0};   // largest quantization error per dimension
+    double d, dA;
+    int B = 64, c = 0;
+    double t1, t2;
+
+    t1 = clock();
+
+    if (argc<=2)      error(4);
+    for (int a = 3; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-q") == 0)
+            quant = true;
+        else if (strcmp(argv[a], "-z") == 0)
+            packed = true;
+        else
+            B = atoi(argv[a]);
+    }
+    if (B<=0 || (packed && quant))
+        error(4);
+
+    fp = fopen(argv[1],"r");
+    if( fp == NULL )
+        error(2);
+
+    out = fopen(argv[2],"wb");
+    if( out == NULL )
+        error(3);
+
+    x = (double *)malloc(sizeof(double)*B);
+    y = (double *)malloc(sizeof(double)*B);
+    code = (int16_t *)malloc(sizeof(int16_t)*2*B);
+    cap = 1024;
+    sum = (BlockSummary *)malloc(sizeof(BlockSummary)*cap);
+    dir = (long long *)malloc(sizeof(long long)*(cap+1));
+    if (packed)
+        words = (uint64_t *)malloc(sizeof(uint64_t)*3*(2+B));
+    if (quant)
+        words = (uint64_t *)malloc(sizeof(uint64_t)*(QUANT_WORDS+5*B+4));
+    if( x == NULL || y == NULL || code == NULL || sum == NULL || dir == NULL || ((packed || quant) && words == NULL) )
+        error(1);
+
+    /// The header is written again at the end, once n is known
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC));
+    h.version = packed ? BLOCK_PACKED : (quant ? BLOCK_QUANTIZED : BLOCK_VERSION);
+    h.block_size = B;
+    if (fwrite(&h, BLOCK_HEADER_SIZE, 1, out) != 1)
+        error(3);
+
+    /// Stream the text file block by block
+    while(fscanf(fp,"%lf\t%lf", &d, &dA) == 2)
+    {
+        x[c] = d;
+        y[c] = dA;
+        c++;
+        h.n++;
+        if (c == B)
+        {
+            if (h.nblocks == cap)
+            {   cap *= 2;
+                sum = (BlockSummary *)realloc(sum, sizeof(BlockSummary)*cap);
+                dir = (long long *)realloc(dir, sizeof(long long)*(cap+1));
+                if( sum == NULL || dir == NULL )
+                    error(1);
+            }
+            dir[h.nblocks] = (long long)ftello(out);
+            write_block(out, quant, x, y, c, &sum[h.nblocks++], code, err, words);
+            c = 0;
+        }
+    }
+    if (c > 0)
+    {
+        if (h.nblocks == cap)
+        {   sum = (BlockSummary *)realloc(sum, sizeof(BlockSummary)*(cap+1));
+            dir = (long long *)realloc(dir, sizeof(long long)*(cap+2));
+            if( sum == NULL || dir == NULL )
+                error(1);
+        }
+        dir[h.nblocks] = (long long)ftello(out);
+        write_block(out, quant, x, y, c, &sum[h.nblocks++], code, err, words);
+    }
+    long long text = (long long)ftello(fp);
+    fclose(fp);
+
+    /// Summaries go after the data, then the header is completed
+    h.summary_offset = (long long)ftello(out);
+    if (fwrite(sum, sizeof(BlockSummary), h.nblocks, out) != (size_t)h.nblocks)
+        error(3);
+
+    /// A quantized or packed file ends with the offset of every block and the end of the last one
+    dir[h.nblocks] = h.summary_offset;
+    if ((packed || quant) && fwrite(dir, sizeof(long long), h.nblocks+1, out) != (size_t)h.nblocks+1)
+        error(3);
+    long long size = (long long)ftello(out);
+    rewind(out);
+    if (fwrite(&h, BLOCK_HEADER_SIZE, 1, out) != 1)
+        error(3);
+    fclose(out);
+
+    free(x);
+    free(y);
+    free(code);
+    free(sum);
+    free(dir);
+    free(words);
+    t2 = clock();
+
+    cout << "Points : " << h.n << endl;
+    cout << "Blocks : " << h.nblocks << " of " << B << " points" << endl;
+    if (h.version == BLOCK_QUANTIZED)
+    {
+        cout << "Quantized : int16, max error " << err[0] << " and " << err[1];
+        cout << (err[0] > 0 || err[1] > 0 ? ", exact with the residuals" : ", lossless");
+        if (h.n > 0)
+            cout << ", " << (double)(h.summary_offset - (long long)BLOCK_HEADER_SIZE)/(2*h.n) << " bytes per value";
+        cout << endl;
+    }
+    if (h.version == BLOCK_PACKED && h.n > 0)
+    {
+        long long data = h.summary_offset - (long long)BLOCK_HEADER_SIZE;
+        cout << "Packed : " << (double)data/(2*h.n) << " bytes per value, data " << (double)16*h.n/data
+             << "x smaller than doubles, file " << (double)text/size << "x smaller than the text" << endl;
+    }
+    cout << "Total Execution Time : " << (t2-t1)/CLOCKS_PER_SEC << " sec" << endl;
+    return 0;
+}
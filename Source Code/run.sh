@@ -5,7 +5,7 @@ if [ ! $# == 3 ]; then
   exit
 fi
 
-echo "FileName,LB_KIM,LB_KEOGH,LB_KEOGH2,DTW,TIME"
+echo "FileName,BLOCKS,LB_KIM,LB_PAA,LB_KEOGH,LB_KEOGH2,DTW,TIME"
 while read fileName count
 do
     echo -n "$fileName,"
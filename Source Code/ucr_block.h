@@ -0,0 +1,532 @@
+/***********************************************************************/
+/** Block file format for 2-dimensional time series.                 **/
+/**                                                                   **/
+/** The file is written once by UCR_PACK and read by UCR_DTW.         **/
+/** Layout:  header | block data | block summaries                    **/
+/**                                                                   **/
+/** Every block holds block_size points (the last one may be shorter) **/
+/** stored column-wise: all x values of the block, then all y values. **/
+/** Each block has a summary with min, max, sum and sum of squares    **/
+/** per dimension, so a search can rule out whole blocks without      **/
+/** ever reading their data.                                          **/
+/**                                                                   **/
+/** A quantized file (version 2) stores each block as int16 codes     **/
+/** with a scale, offset and error bound per dimension, and for a     **/
+/** lossy dimension the residual that gives back the exact values:   **/
+/**   header | BlockQuant, x codes, y codes, residuals per block      **/
+/**          | summaries | directory                                 **/
+/** The summaries always describe the exact values.                  **/
+/**                                                                   **/
+/** A packed file (version 3) is lossless and compressed. Each block  **/
+/** stores per dimension a PackHead and the bit-packed differences of **/
+/** successive values, so blocks differ in size:                      **/
+/**   header | packed blocks | summaries | directory                  **/
+/** The directory of both holds the file offset of every block and    **/
+/** one past the last; block_read_header loads it into BlockHeader.dir.**/
+/***********************************************************************/
+
+#ifndef UCR_BLOCK_H
+#define UCR_BLOCK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BLOCK_MAGIC     "UCRBLK1"
+#define BLOCK_VERSION   1        /// doubles
+#define BLOCK_QUANTIZED 2        /// int16 codes with a scale and offset per block
+#define BLOCK_PACKED    3        /// bit-packed deltas or XORs, lossless
+
+/// Fixed size header at the beginning of a block file
+typedef struct BlockHeader
+    {   char      magic[8];
+        int       version;
+        int       block_size;      /// points per block
+        long long n;               /// total number of points
+        long long nblocks;         /// number of blocks, ceil(n/block_size)
+        long long summary_offset;  /// file offset of the block summaries
+        long long *dir;            /// in memory only: block offsets of a quantized or packed file, else NULL
+        uint64_t  *pack;           /// in memory only: read buffer for the largest such block
+    } BlockHeader;
+
+/// Bytes of the header in the file
+#define BLOCK_HEADER_SIZE offsetof(BlockHeader, dir)
+
+/// Per-block summary, index 0 for the first dimension and 1 for the second
+typedef struct BlockSummary
+    {   double min[2], max[2];
+        double sum[2], sum2[2];
+    } BlockSummary;
+
+/// Decoding of a quantized block, index 0 for the first dimension and 1 for the second.
+/// A value is offset + scale*code, at most err away from the original one. scale is a power
+/// of two and offset a multiple of it, so blocks of the same scale share one grid of values.
+typedef struct BlockQuant
+    {   double offset[2], scale[2];
+        double err[2];
+    } BlockQuant;
+
+/// A quantized block record: BlockQuant, c x codes, c y codes, padded to 64-bit words, then the
+/// residual (see block_residual) of each dimension with err > 0.
+#define QUANT_WORDS ((int)(sizeof(BlockQuant)/sizeof(uint64_t)))
+static inline int16_t *quant_codes(uint64_t *rec)
+{
+    return (int16_t *)(rec + QUANT_WORDS);
+}
+static inline uint64_t *quant_residual(uint64_t *rec, int c)
+{
+    return rec + QUANT_WORDS + (c*2*(int)sizeof(int16_t) + 7)/8;
+}
+
+/// One dimension of a packed block: the first value, then the other c-1 as codes of width
+/// bits, packed from the lowest bit of 64-bit words on.
+///  PACK_DELTA: the values are integers k/10^exp; a code is the zigzag coded difference of
+///              successive k, first holds k of the first value.
+///  PACK_XOR:   a code is the XOR of the bits of successive values, shifted right by exp;
+///              first holds the bits of the first value.
+#define PACK_DELTA 0
+#define PACK_XOR   1
+typedef struct PackHead
+    {   uint8_t   mode, width, exp, pad[5];
+        int64_t   first;
+    } PackHead;
+
+/// Number of points in block b
+static inline int block_count(const BlockHeader *h, long long b)
+{
+    long long left = h->n - b*h->block_size;
+    return left < h->block_size ? (int)left : h->block_size;
+}
+
+/// File offset of the data of block b
+static inline off_t block_offset(const BlockHeader *h, long long b)
+{
+    if (h->dir != NULL)
+        return (off_t)h->dir[b];
+    return (off_t)BLOCK_HEADER_SIZE + (off_t)b*h->block_size*2*sizeof(double);
+}
+
+/// Read the header, and the directory of a quantized or packed file; return 0 if the file is
+/// not a block file. Such a file also gets the read buffer of block_read, sized for its largest
+/// block and block_size work words. The file position is left undefined; block_free_header
+/// frees what this allocated.
+static inline int block_read_header(FILE *fp, BlockHeader *h)
+{
+    memset(h, 0, sizeof(BlockHeader));
+    rewind(fp);
+    if (fread(h, BLOCK_HEADER_SIZE, 1, fp) != 1)
+        return 0;
+    if (memcmp(h->magic, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0 ||
+        (h->version != BLOCK_VERSION && h->version != BLOCK_QUANTIZED && h->version != BLOCK_PACKED))
+        return 0;
+    if (h->version == BLOCK_VERSION)
+        return 1;
+    h->dir = (long long *)malloc(sizeof(long long)*(h->nblocks+1));
+    if (h->dir == NULL ||
+        fseeko(fp, (off_t)h->summary_offset + (off_t)h->nblocks*sizeof(BlockSummary), SEEK_SET) != 0 ||
+        fread(h->dir, sizeof(long long), h->nblocks+1, fp) != (size_t)h->nblocks+1)
+    {   free(h->dir);
+        h->dir = NULL;
+        return 0;
+    }
+    long long nw = 0;
+    for (long long b = 0; b < h->nblocks; b++)
+        if (h->dir[b+1] - h->dir[b] > nw)
+            nw = h->dir[b+1] - h->dir[b];
+    nw /= (long long)sizeof(uint64_t);
+    h->pack = (uint64_t *)malloc(sizeof(uint64_t)*(nw + h->block_size));
+    if (h->pack == NULL)
+    {   free(h->dir);
+        h->dir = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static inline void block_free_header(BlockHeader *h)
+{
+    free(h->dir);
+    free(h->pack);
+    h->dir = NULL;
+    h->pack = NULL;
+}
+
+/// Number of leading zero bits of a 64-bit word, 64 for 0
+static inline int pack_clz(uint64_t u)
+{
+    return u == 0 ? 64 : __builtin_clzll(u);
+}
+
+/// Width in bits of the largest of the n codes
+static inline int pack_width(const uint64_t *code, int n)
+{
+    uint64_t all = 0;
+    for (int i = 0; i < n; i++)
+        all |= code[i];
+    return 64 - pack_clz(all);
+}
+
+/// Write n codes of width bits to out, from the lowest bit of its words on; return the number
+/// of words used
+static inline int pack_bits(const uint64_t *code, int n, int width, uint64_t *out)
+{
+    int nw = (int)(((long long)n*width + 63)/64);
+    memset(out, 0, sizeof(uint64_t)*nw);
+    for (int i = 0; i < n; i++)
+    {   long long bit = (long long)i*width;
+        int s = (int)(bit & 63);
+        out[bit>>6] |= code[i] << s;
+        if (s + width > 64)
+            out[(bit>>6) + 1] |= code[i] >> (64-s);
+    }
+    return nw;
+}
+
+/// Take apart n codes of width bits written by pack_bits; return the number of words read
+static inline int unpack_bits(const uint64_t *w, int n, int width, uint64_t *code)
+{
+    uint64_t mask = width == 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+
+    if (width == 0)
+        memset(code, 0, sizeof(uint64_t)*n);
+    else
+        for (int i = 0; i < n; i++)
+        {   long long bit = (long long)i*width;
+            int s = (int)(bit & 63);
+            uint64_t u = w[bit>>6] >> s;
+            if (s + width > 64)
+                u |= w[(bit>>6) + 1] << (64-s);
+            code[i] = u & mask;
+        }
+    return (int)(((long long)n*width + 63)/64);
+}
+
+/// Exact powers of ten for PACK_DELTA
+static const double pack_pow10[16] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+                                       1e14, 1e15 };
+
+/// Write c >= 1 values of one dimension as a PackHead and codes to out; return the number of
+/// 64-bit words used, at most 2+c. Values which are all k/10^exp for integers k, as read from
+/// text with exp decimals, become differences of k; the others XORs of their bits.
+/// code is a work array of c words.
+static inline int block_pack(const double *v, int c, uint64_t *out, uint64_t *code)
+{
+    PackHead ph;
+    int e, i;
+
+    memset(&ph, 0, sizeof(ph));
+    for (e = 0; e < 16; e++)
+    {
+        int64_t prev = 0;
+        for (i = 0; i < c; i++)
+        {   double k = v[i]*pack_pow10[e], back = (double)llround(k)/pack_pow10[e];
+            /// Bit for bit, or -0.0 would come back as 0.0
+            if (!(fabs(k) < 9007199254740992.0) || memcmp(&back, &v[i], sizeof(double)) != 0)
+                break;
+            int64_t n = llround(k);
+            if (i == 0)
+                ph.first = n;
+            else
+            {   int64_t d = n - prev;
+                code[i-1] = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+            }
+            prev = n;
+        }
+        if (i == c)
+            break;
+    }
+    if (e < 16)
+    {   ph.mode = PACK_DELTA;
+        ph.exp = e;
+    }
+    else
+    {   uint64_t prev, u;
+        int tz = 64;
+        memcpy(&prev, &v[0], sizeof(prev));
+        memcpy(&ph.first, &prev, sizeof(prev));
+        for (i = 1; i < c; i++)
+        {   memcpy(&u, &v[i], sizeof(u));
+            code[i-1] = u ^ prev;
+            prev = u;
+            if (code[i-1] != 0 && __builtin_ctzll(code[i-1]) < tz)
+                tz = __builtin_ctzll(code[i-1]);
+        }
+        ph.mode = PACK_XOR;
+        ph.exp = tz == 64 ? 0 : tz;
+        for (i = 0; i < c-1; i++)
+            code[i] >>= ph.exp;
+    }
+    ph.width = pack_width(code, c-1);
+    memcpy(out, &ph, sizeof(ph));
+    return 2 + pack_bits(code, c-1, ph.width, out+2);
+}
+
+/// Decode c values packed by block_pack from in into v; return the number of words read.
+/// The codes are taken apart independently of each other, and the running sum is separate,
+/// so the compiler can vectorize the other loops; code is a work array of c words.
+static inline int block_unpack(const uint64_t *in, int c, double *v, uint64_t *code)
+{
+    PackHead ph;
+    memcpy(&ph, in, sizeof(ph));
+    int nw = unpack_bits(in+2, c-1, ph.width, code), i;
+
+    if (ph.mode == PACK_DELTA)
+    {
+        int64_t *k = (int64_t *)code;
+        double p = pack_pow10[ph.exp];
+        for (i = 0; i < c-1; i++)
+            k[i] = (int64_t)(code[i] >> 1) ^ -(int64_t)(code[i] & 1);
+        v[0] = (double)ph.first/p;
+        int64_t n = ph.first;
+        for (i = 0; i < c-1; i++)
+        {   n += k[i];
+            v[i+1] = (double)n/p;
+        }
+    }
+    else
+    {
+        uint64_t u = (uint64_t)ph.first;
+        memcpy(&v[0], &u, sizeof(u));
+        for (i = 0; i < c-1; i++)
+        {   u ^= code[i] << ph.exp;
+            memcpy(&v[i+1], &u, sizeof(u));
+        }
+    }
+    return 2 + nw;
+}
+
+/// Write the residual of c exact values v against their decoded values q to out; return the
+/// number of 64-bit words used, at most 2+c. As in block_pack, values which are all k/10^exp
+/// keep k - llround(q*10^exp), zigzag coded, and the others the XOR of the bits of v and q,
+/// shifted right by exp. A fine enough grid leaves only zeros, which take no bits at all.
+/// code is a work array of c words.
+static inline int block_residual(const double *v, const double *q, int c, uint64_t *out, uint64_t *code)
+{
+    PackHead ph;
+    int e, i;
+
+    memset(&ph, 0, sizeof(ph));
+    for (e = 0; e < 16; e++)
+    {
+        for (i = 0; i < c; i++)
+        {   double k = v[i]*pack_pow10[e], back = (double)llround(k)/pack_pow10[e], kq = q[i]*pack_pow10[e];
+            if (!(fabs(k) < 9007199254740992.0) || !(fabs(kq) < 9007199254740992.0) ||
+                memcmp(&back, &v[i], sizeof(double)) != 0)
+                break;
+            int64_t d = llround(k) - llround(kq);
+            code[i] = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+        }
+        if (i == c)
+            break;
+    }
+    if (e < 16)
+    {   ph.mode = PACK_DELTA;
+        ph.exp = e;
+    }
+    else
+    {   uint64_t u, w;
+        int tz = 64;
+        for (i = 0; i < c; i++)
+        {   memcpy(&u, &v[i], sizeof(u));
+            memcpy(&w, &q[i], sizeof(w));
+            code[i] = u ^ w;
+            if (code[i] != 0 && __builtin_ctzll(code[i]) < tz)
+                tz = __builtin_ctzll(code[i]);
+        }
+        ph.mode = PACK_XOR;
+        ph.exp = tz == 64 ? 0 : tz;
+        for (i = 0; i < c; i++)
+            code[i] >>= ph.exp;
+    }
+    ph.width = pack_width(code, c);
+    memcpy(out, &ph, sizeof(ph));
+    return 2 + pack_bits(code, c, ph.width, out+2);
+}
+
+/// Rebuild c exact values v from their decoded values q and the residual written by
+/// block_residual at in; return the number of words read. v may be q.
+static inline int block_unresidual(const uint64_t *in, const double *q, int c, double *v, uint64_t *code)
+{
+    PackHead ph;
+    memcpy(&ph, in, sizeof(ph));
+    int nw = unpack_bits(in+2, c, ph.width, code), i;
+
+    if (ph.mode == PACK_DELTA)
+    {
+        double p = pack_pow10[ph.exp];
+        for (i = 0; i < c; i++)
+        {   int64_t d = (int64_t)(code[i] >> 1) ^ -(int64_t)(code[i] & 1);
+            v[i] = (double)(llround(q[i]*p) + d)/p;
+        }
+    }
+    else
+        for (i = 0; i < c; i++)
+        {   uint64_t u;
+            memcpy(&u, &q[i], sizeof(u));
+            u ^= code[i] << ph.exp;
+            memcpy(&v[i], &u, sizeof(u));
+        }
+    return 2 + nw;
+}
+
+/// Decode the quantized block record rec of c points into x and y, exactly: the codes, and the
+/// residual of every lossy dimension. work has room for c words.
+static inline void block_decode(uint64_t *rec, int c, double *x, double *y, uint64_t *work)
+{
+    BlockQuant bq;
+    int16_t *code = quant_codes(rec);
+    uint64_t *res = quant_residual(rec, c);
+    double *v[2] = { x, y };
+
+    memcpy(&bq, rec, sizeof(bq));
+    for (int d = 0; d < 2; d++)
+    {
+        for (int i = 0; i < c; i++)
+            v[d][i] = bq.offset[d] + bq.scale[d]*code[d*c+i];
+        if (bq.err[d] > 0)
+            res += block_unresidual(res, v[d], c, v[d], work);
+    }
+}
+
+/// Read all block summaries into sum (nblocks entries).
+static inline int block_read_summaries(FILE *fp, const BlockHeader *h, BlockSummary *sum)
+{
+    if (fseeko(fp, (off_t)h->summary_offset, SEEK_SET) != 0)
+        return 0;
+    return fread(sum, sizeof(BlockSummary), h->nblocks, fp) == (size_t)h->nblocks;
+}
+
+/// Read the record of block b of a quantized or packed file into rec, as it is in the file;
+/// returns the number of points in it, 0 on failure.
+static inline int block_read_record(FILE *fp, const BlockHeader *h, long long b, uint64_t *rec)
+{
+    long long nw = (h->dir[b+1] - h->dir[b])/(long long)sizeof(uint64_t);
+    off_t off = block_offset(h, b);
+    /// Blocks are mostly read in order; only seek when jumping, so stdio keeps its buffer
+    if (ftello(fp) != off && fseeko(fp, off, SEEK_SET) != 0)
+        return 0;
+    return fread(rec, sizeof(uint64_t), nw, fp) == (size_t)nw ? block_count(h, b) : 0;
+}
+
+/// Read the data of block b into x and y, exactly; return the number of points read.
+/// A packed or quantized block is decoded straight into x and y.
+static inline int block_read(FILE *fp, const BlockHeader *h, long long b, double *x, double *y)
+{
+    int c = block_count(h, b);
+    if (h->version == BLOCK_PACKED)
+    {
+        long long nw = (h->dir[b+1] - h->dir[b])/(long long)sizeof(uint64_t);
+        uint64_t *in = h->pack;
+        if (block_read_record(fp, h, b, in) != c)
+            return 0;
+        int used = block_unpack(in, c, x, in+nw);
+        return used < nw && block_unpack(in+used, c, y, in+nw) + used == nw ? c : 0;
+    }
+    if (h->version == BLOCK_QUANTIZED)
+    {
+        long long nw = (h->dir[b+1] - h->dir[b])/(long long)sizeof(uint64_t);
+        if (block_read_record(fp, h, b, h->pack) != c)
+            return 0;
+        block_decode(h->pack, c, x, y, h->pack+nw);
+        return c;
+    }
+
+    off_t off = block_offset(h, b);
+    if (ftello(fp) != off && fseeko(fp, off, SEEK_SET) != 0)
+        return 0;
+    if (fread(x, sizeof(double), c, fp) != (size_t)c)
+        return 0;
+    if (fread(y, sizeof(double), c, fp) != (size_t)c)
+        return 0;
+    return c;
+}
+
+/// Read the m points starting at global index p into x and y, block by block.
+/// bx, by hold one block; *cached is the index of the block in them (-1 for none),
+/// so neighbouring windows do not read the same block twice.
+static inline int block_read_window(FILE *fp, const BlockHeader *h, long long p, int m, double *x, double *y,
+                                    double *bx, double *by, long long *cached)
+{
+    int B = h->block_size, k = 0;
+    while (k < m)
+    {
+        long long b = (p+k)/B;
+        if (b != *cached)
+        {
+            if (block_read(fp, h, b, bx, by) == 0)
+                return 0;
+            *cached = b;
+        }
+        int o = (int)((p+k) - b*B);
+        int c = B-o < m-k ? B-o : m-k;
+        memcpy(x+k, bx+o, sizeof(double)*c);
+        memcpy(y+k, by+o, sizeof(double)*c);
+        k += c;
+    }
+    return 1;
+}
+
+/// Summarize c points of a block
+static inline void block_summarize(const double *x, const double *y, int c, BlockSummary *s)
+{
+    const double *v[2] = { x, y };
+    for (int d = 0; d < 2; d++)
+    {
+        s->min[d] = s->max[d] = v[d][0];
+        s->sum[d] = s->sum2[d] = 0;
+        for (int i = 0; i < c; i++)
+        {
+            if (v[d][i] < s->min[d]) s->min[d] = v[d][i];
+            if (v[d][i] > s->max[d]) s->max[d] = v[d][i];
+            s->sum[d] += v[d][i];
+            s->sum2[d] += v[d][i]*v[d][i];
+        }
+    }
+}
+
+/// Grid of int16 codes for values in lo..hi: scale is the smallest power of two with hi-lo at
+/// most steps*scale, offset a multiple of it with lo at code -32768 or a bit above. Constant
+/// values get the unit of their last bit, so they are kept exactly.
+static inline void quant_grid(double lo, double hi, double steps, double *scale, double *offset)
+{
+    int e;
+    if (hi > lo)
+    {   frexp((hi-lo)/steps, &e);
+        *scale = ldexp(1, e);
+        if (*scale/2 >= (hi-lo)/steps)
+            *scale /= 2;
+    }
+    else
+        *scale = lo != 0 ? ldexp(1, ilogb(lo)-52) : 1;
+    *offset = *scale*(floor(lo / *scale) + 32768);
+}
+
+/// Quantize c values of one dimension to int16 codes on the grid of their range, 65535 steps.
+/// Integers within a range of 65535 (ADC output) are kept exactly.
+/// bq->err[d] is the largest error of the decoded values.
+static inline void block_quantize(const double *v, int c, BlockQuant *bq, int d, int16_t *code)
+{
+    double lo = v[0], hi = v[0];
+    for (int i = 0; i < c; i++)
+    {
+        if (v[i] < lo) lo = v[i];
+        if (v[i] > hi) hi = v[i];
+    }
+    quant_grid(lo, hi, 65535, &bq->scale[d], &bq->offset[d]);
+    bq->err[d] = 0;
+    for (int i = 0; i < c; i++)
+    {
+        double k = floor((v[i] - bq->offset[d])/bq->scale[d] + 0.5);
+        k = k < -32768 ? -32768 : (k > 32767 ? 32767 : k);
+        code[i] = (int16_t)k;
+        double e = fabs(v[i] - (bq->offset[d] + bq->scale[d]*code[i]));
+        if (e > bq->err[d])
+            bq->err[d] = e;
+    }
+}
+
+#endif
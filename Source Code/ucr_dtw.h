@@ -0,0 +1,674 @@
+/***********************************************************************/
+/************************* DISCLAIMER **********************************/
+/***********************************************************************/
+/** This UCR Suite software is copyright protected � 2012 by          **/
+/** Thanawin Rakthanmanon, Bilson Campana, Abdullah Mueen,            **/
+/** Gustavo Batista and Eamonn Keogh.                                 **/
+/**                                                                   **/
+/** Unless stated otherwise, all software is provided free of charge. **/
+/** As well, all software is provided on an "as is" basis without     **/
+/** warranty of any kind, express or implied. Under no circumstances  **/
+/** and under no legal theory, whether in tort, contract,or otherwise,**/
+/** shall Thanawin Rakthanmanon, Bilson Campana, Abdullah Mueen,      **/
+/** Gustavo Batista, or Eamonn Keogh be liable to you or to any other **/
+/** person for any indirect, special, incidental, or consequential    **/
+/** damages of any character including, without limitation, damages   **/
+/** for loss of goodwill, work stoppage, computer failure or          **/
+/** malfunction, or for any and all other damages or losses.          **/
+/**                                                                   **/
+/** If you do not agree with these terms, then you you are advised to **/
+/** not use this software.                                            **/
+/***********************************************************************/
+/***********************************************************************/
+
+/***********************************************************************/
+/** Shared kernels of the UCR suite: envelopes, lower bounds and DTW. **/
+/** Used by UCR_DTW and by the programs built on the same cascade.    **/
+/***********************************************************************/
+
+#ifndef UCR_DTW_H
+#define UCR_DTW_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+
+#define min(x,y) ((x)<(y)?(x):(y))
+#define max(x,y) ((x)>(y)?(x):(y))
+#define dist(x,y) ((x-y)*(x-y))
+
+#define INF 1e20       //Pseudo Infitinte number for this code
+
+/// Data structure for sorting the query
+typedef struct Index
+    {   double value;
+        int    index;
+    } Index;
+
+/// One position of the query in sorted order with its envelope there. The sorted LB_Keogh
+/// loops read a single record per step, two records per cache line.
+typedef struct SortedPoint
+    {   double uo, lo;     /// upper and lower envelope of the query at order
+        double qo;         /// the query at order
+        int    order;      /// position in the query
+        int    pad;
+    } SortedPoint;
+
+/// Data structure (circular array) for finding minimum and maximum for LB_Keogh envolop
+struct deque
+{   int *dq;
+    int size,capacity;
+    int f,r;
+};
+
+
+/// Sorting function for the query, sort by abs(z_norm(q[i])) from high to low.
+/// The magnitudes are compared as doubles, an int difference would make all of them
+/// below 1 apart equal; equal ones keep the order of their index.
+int comp(const void *a, const void* b)
+{   Index* x = (Index*)a;
+    Index* y = (Index*)b;
+    double ax = fabs(x->value), ay = fabs(y->value);
+    if (ax != ay)
+        return ax < ay ? 1 : -1;   // high to low
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/// Length of the runs of a query order with -sort runs. The LB_Keogh loops read the
+/// candidate at the positions of the order; ranked one by one those jump around the
+/// subsequence and the reads may miss the cache, in runs of consecutive positions (16 doubles,
+/// two cache lines) they stay sequential within a run.
+#define ORDER_RUN 16
+
+/// Defined by every program that includes this header
+void error(int id);
+
+/// Order of the m positions by score from high to low, in runs of run consecutive positions
+/// ranked by their mean score; run 1 is the exact order. Within a run the positions keep
+/// their order.
+void order_runs(double *score, int m, int *order, int run)
+{
+    int nr = (m+run-1)/run, n = 0;
+    Index *r = (Index *)malloc(sizeof(Index)*nr);
+    if( r == NULL )
+        error(1);
+    for (int k = 0; k < nr; k++)
+    {   int e = min(m, (k+1)*run);
+        r[k].value = 0;
+        for (int i = k*run; i < e; i++)
+            r[k].value += score[i];
+        r[k].value /= e - k*run;
+        r[k].index = k;
+    }
+    qsort(r, nr, sizeof(Index), comp);
+    for (int k = 0; k < nr; k++)
+    {   int e = min(m, (r[k].index+1)*run);
+        for (int i = r[k].index*run; i < e; i++)
+            order[n++] = i;
+    }
+    free(r);
+}
+
+/// Order of a z-normalized query q by abs(q[i]), exact for run 1, else in runs (see order_runs)
+void query_order(double *q, int m, int *order, int run)
+{
+    double *score = (double *)malloc(sizeof(double)*m);
+    if( score == NULL )
+        error(1);
+    for (int i = 0; i < m; i++)
+        score[i] = fabs(q[i]);
+    order_runs(score, m, order, run);
+    free(score);
+}
+
+/// Sorting function for plain values, low to high
+int comp_value(const void *a, const void* b)
+{   double x = *(double*)a;
+    double y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+/// Initial the queue at the begining step of envelop calculation
+void init(deque *d, int capacity)
+{
+    d->capacity = capacity;
+    d->size = 0;
+    d->dq = (int *) malloc(sizeof(int)*d->capacity);
+    d->f = 0;
+    d->r = d->capacity-1;
+}
+
+/// Destroy the queue
+void destroy(deque *d)
+{
+    free(d->dq);
+}
+
+/// Insert to the queue at the back
+void push_back(struct deque *d, int v)
+{
+    d->dq[d->r] = v;
+    d->r--;
+    if (d->r < 0)
+        d->r = d->capacity-1;
+    d->size++;
+}
+
+/// Delete the current (front) element from queue
+void pop_front(struct deque *d)
+{
+    d->f--;
+    if (d->f < 0)
+        d->f = d->capacity-1;
+    d->size--;
+}
+
+/// Delete the last element from queue
+void pop_back(struct deque *d)
+{
+    d->r = (d->r+1)%d->capacity;
+    d->size--;
+}
+
+/// Get the value at the current position of the circular queue
+int front(struct deque *d)
+{
+    int aux = d->f - 1;
+
+    if (aux < 0)
+        aux = d->capacity-1;
+    return d->dq[aux];
+}
+
+/// Get the value at the last position of the circular queueint back(struct deque *d)
+int back(struct deque *d)
+{
+    int aux = (d->r+1)%d->capacity;
+    return d->dq[aux];
+}
+
+/// Check whether or not the queue is empty
+int empty(struct deque *d)
+{
+    return d->size == 0;
+}
+
+/// Finding the envelop of min and max value for LB_Keogh
+/// Implementation idea is intoruduced by Danial Lemire in his paper
+/// "Faster Retrieval with a Two-Pass Dynamic-Time-Warping Lower Bound", Pattern Recognition 42(9), 2009.
+/// t is double, or the int16 codes of a quantized chunk, and l, u the same.
+template <typename V>
+void lower_upper_lemire(V *t, int len, int r, V *l, V *u)
+{
+    struct deque du, dl;
+
+    init(&du, 2*r+2);
+    init(&dl, 2*r+2);
+
+    push_back(&du, 0);
+    push_back(&dl, 0);
+
+    for (int i = 1; i < len; i++)
+    {
+        if (i > r)
+        {
+            u[i-r-1] = t[front(&du)];
+            l[i-r-1] = t[front(&dl)];
+        }
+        if (t[i] > t[i-1])
+        {
+            pop_back(&du);
+            while (!empty(&du) && t[i] > t[back(&du)])
+                pop_back(&du);
+        }
+        else
+        {
+            pop_back(&dl);
+            while (!empty(&dl) && t[i] < t[back(&dl)])
+                pop_back(&dl);
+        }
+        push_back(&du, i);
+        push_back(&dl, i);
+        if (i == 2 * r + 1 + front(&du))
+            pop_front(&du);
+        else if (i == 2 * r + 1 + front(&dl))
+            pop_front(&dl);
+    }
+    for (int i = len; i < len+r+1; i++)
+    {
+        u[i-r-1] = t[front(&du)];
+        l[i-r-1] = t[front(&dl)];
+        if (i-front(&du) >= 2 * r + 1)
+            pop_front(&du);
+        if (i-front(&dl) >= 2 * r + 1)
+            pop_front(&dl);
+    }
+    destroy(&du);
+    destroy(&dl);
+}
+
+/// Calculate quick lower bound
+/// Usually, LB_Kim take time O(m) for finding top,bottom,fist and last.
+/// However, because of z-normalization the top and bottom cannot give siginifant benefits.
+/// And using the first and last points can be computed in constant time.
+/// The prunning power of LB_Kim is non-trivial, especially when the query is not long, say in length 128.
+/// The data t may be codes, see lower_upper_lemire; mean and std are in their units then.
+template <typename V>
+double lb_kim_hierarchy(V *t, double *q, int j, int len, double mean, double std, double bsf = INF)
+{
+    /// 1 point at front and back
+    double d, lb;
+    double x0 = (t[j] - mean) / std;
+    double y0 = (t[(len-1+j)] - mean) / std;
+    lb = dist(x0,q[0]) + dist(y0,q[len-1]);
+    if (lb >= bsf)   return lb;
+
+    /// 2 points at front
+    double x1 = (t[(j+1)] - mean) / std;
+    d = min(dist(x1,q[0]), dist(x0,q[1]));
+    d = min(d, dist(x1,q[1]));
+    lb += d;
+    if (lb >= bsf)   return lb;
+
+    /// 2 points at back
+    double y1 = (t[(len-2+j)] - mean) / std;
+    d = min(dist(y1,q[len-1]), dist(y0, q[len-2]) );
+    d = min(d, dist(y1,q[len-2]));
+    lb += d;
+    if (lb >= bsf)   return lb;
+
+    /// 3 points at front
+    double x2 = (t[(j+2)] - mean) / std;
+    d = min(dist(x0,q[2]), dist(x1, q[2]));
+    d = min(d, dist(x2,q[2]));
+    d = min(d, dist(x2,q[1]));
+    d = min(d, dist(x2,q[0]));
+    lb += d;
+    if (lb >= bsf)   return lb;
+
+    /// 3 points at back
+    double y2 = (t[(len-3+j)] - mean) / std;
+    d = min(dist(y0,q[len-3]), dist(y1, q[len-3]));
+    d = min(d, dist(y2,q[len-3]));
+    d = min(d, dist(y2,q[len-2]));
+    d = min(d, dist(y2,q[len-1]));
+    lb += d;
+
+    return lb;
+}
+
+/// Number of consecutive starts for which lb_kim_block works at once
+#define KIM_LANES 8
+
+/// All levels of lb_kim_hierarchy for KIM_LANES starts in a row: start k is the subsequence
+/// t[k..k+len-1] with mean[k] and std[k]. There are no early exits, so the lanes are independent
+/// and the loop is vectorized; every lane gives the value the scalar version returns when it
+/// does not abandon.
+template <typename V>
+static inline void lb_kim_lanes(const V *t, const double *q, int len, const double *mean, const double *std,
+                                double *__restrict__ lb)
+{
+    double q0 = q[0], q1 = q[1], q2 = q[2], z0 = q[len-1], z1 = q[len-2], z2 = q[len-3];
+    for (int k = 0; k < KIM_LANES; k++)
+    {
+        double d, s;
+        double x0 = (t[k] - mean[k]) / std[k];
+        double y0 = (t[len-1+k] - mean[k]) / std[k];
+        double x1 = (t[k+1] - mean[k]) / std[k];
+        double y1 = (t[len-2+k] - mean[k]) / std[k];
+        double x2 = (t[k+2] - mean[k]) / std[k];
+        double y2 = (t[len-3+k] - mean[k]) / std[k];
+        s = dist(x0,q0) + dist(y0,z0);
+
+        d = min(dist(x1,q0), dist(x0,q1));
+        d = min(d, dist(x1,q1));
+        s += d;
+
+        d = min(dist(y1,z0), dist(y0,z1));
+        d = min(d, dist(y1,z1));
+        s += d;
+
+        d = min(dist(x0,q2), dist(x1,q2));
+        d = min(d, dist(x2,q2));
+        d = min(d, dist(x2,q1));
+        d = min(d, dist(x2,q0));
+        s += d;
+
+        d = min(dist(y0,z2), dist(y1,z2));
+        d = min(d, dist(y2,z2));
+        d = min(d, dist(y2,z1));
+        d = min(d, dist(y2,z0));
+        lb[k] = s + d;
+    }
+}
+
+/// LB_Kim of both dimensions for KIM_LANES consecutive starts of a chunk x, y, with the means
+/// and stds of every start. lb gets the sums of both dimensions; bit k of the result is set if
+/// start k has a sum below bsf and may survive. A constant subsequence never does.
+template <typename V>
+unsigned lb_kim_block(const V *x, const V *y, const double *q, const double *qA, int len,
+                      const double *mean, const double *std, const double *meanA, const double *stdA,
+                      double bsf, double *lb)
+{
+    double a[KIM_LANES], b[KIM_LANES];
+    unsigned mask = 0;
+
+    lb_kim_lanes(x, q, len, mean, std, a);
+    lb_kim_lanes(y, qA, len, meanA, stdA, b);
+    for (int k = 0; k < KIM_LANES; k++)
+    {   lb[k] = a[k] + b[k];
+        mask |= (unsigned)(lb[k] < bsf) << k;
+    }
+    return mask;
+}
+
+/// PAA envelope of the query, computed once.
+/// Segment s covers positions [s*w, min(m,(s+1)*w)); its upper (lower) value is
+/// the max of u (min of l) over the segment.
+void paa_envelope(double *l, double *u, int m, int w, double *pl, double *pu)
+{
+    for (int a = 0, s = 0; a < m; a += w, s++)
+    {
+        pl[s] = l[a];
+        pu[s] = u[a];
+        for (int i = a+1; i < min(m, a+w); i++)
+        {
+            pl[s] = min(pl[s], l[i]);
+            pu[s] = max(pu[s], u[i]);
+        }
+    }
+}
+
+/// LB_PAA: lower bound of LB_Keogh from the segment means of the data, O(m/w).
+/// The squared distance to an interval is convex, so the w points of a segment cost at least
+/// w times the distance of their z-normalized mean to the segment envelope.
+///
+/// Variable Explanation,
+/// P     : prefix sums of the data, P[k] is the sum of the k points before the candidate start (exclusive)
+/// pl, pu: PAA envelope of the query
+double lb_paa(double *P, double *pl, double *pu, int m, int w, double mean, double std, double best_so_far = INF)
+{
+    double lb = 0;
+    double x, d;
+    int a, e, s;
+
+    for (a = 0, s = 0; a < m && lb < best_so_far; a += w, s++)
+    {
+        e = min(m, a+w);
+        x = ((P[e]-P[a])/(e-a) - mean) / std;
+        d = 0;
+        if (x > pu[s])
+            d = dist(x,pu[s]);
+        else if(x < pl[s])
+            d = dist(x,pl[s]);
+        lb += (e-a)*d;
+    }
+    return lb;
+}
+
+/// LB_Keogh 1: Create Envelop for the query
+/// Note that because the query is known, envelop can be created once at the begenining.
+///
+/// Variable Explanation,
+/// order : sorted indices for the query.
+/// uo, lo: upper and lower envelops for the query, which already sorted.
+/// t     : a circular array keeping the current data.
+/// j     : index of the starting location in t
+/// cb    : (output) current bound at each position. It will be used later for early abandoning in DTW.
+double lb_keogh_cumulative(int* order, double *t, double *uo, double *lo, double *cb, int j, int len, double mean, double std, double best_so_far = INF)
+{
+    double lb = 0;
+    double x, d;
+
+    for (int i = 0; i < len && lb < best_so_far; i++)
+    {
+        x = (t[(order[i]+j)] - mean) / std;
+        d = 0;
+        if (x > uo[i])
+            d = dist(x,uo[i]);
+        else if(x < lo[i])
+            d = dist(x,lo[i]);
+        lb += d;
+        cb[order[i]] = d;
+    }
+    return lb;
+}
+
+/// LB_Keogh 2: Create Envelop for the data
+/// Note that the envelops have been created (in main function) when each data point has been read.
+///
+/// Variable Explanation,
+/// tz: Z-normalized data
+/// qo: sorted query
+/// cb: (output) current bound at each position. Used later for early abandoning in DTW.
+/// l,u: lower and upper envelop of the current data
+double lb_keogh_data_cumulative(int* order, double *tz, double *qo, double *cb, double *l, double *u, int len, double mean, double std, double best_so_far = INF)
+{
+    double lb = 0;
+    double uu,ll,d;
+
+    for (int i = 0; i < len && lb < best_so_far; i++)
+    {
+        uu = (u[order[i]]-mean)/std;
+        ll = (l[order[i]]-mean)/std;
+        d = 0;
+        if (qo[i] > uu)
+            d = dist(qo[i], uu);
+        else
+        {   if(qo[i] < ll)
+            d = dist(qo[i], ll);
+        }
+        lb += d;
+        cb[order[i]] = d;
+    }
+    return lb;
+}
+
+/// LB_Keogh 1 over the sorted records of the query (see SortedPoint); t may be codes
+template <typename V>
+double lb_keogh_sorted(SortedPoint *so, V *t, double *cb, int j, int len, double mean, double std, double best_so_far)
+{
+    double lb = 0;
+    double x, d;
+
+    for (int i = 0; i < len && lb < best_so_far; i++)
+    {
+        x = (t[(so[i].order+j)] - mean) / std;
+        d = 0;
+        if (x > so[i].uo)
+            d = dist(x,so[i].uo);
+        else if(x < so[i].lo)
+            d = dist(x,so[i].lo);
+        lb += d;
+        cb[so[i].order] = d;
+    }
+    return lb;
+}
+
+/// LB_Keogh 2 over the sorted records of the query; l, u are the envelope of the data, or of its codes
+template <typename V>
+double lb_keogh_data_sorted(SortedPoint *so, double *cb, V *l, V *u, int len, double mean, double std, double best_so_far)
+{
+    double lb = 0;
+    double uu,ll,d;
+
+    for (int i = 0; i < len && lb < best_so_far; i++)
+    {
+        uu = (u[so[i].order]-mean)/std;
+        ll = (l[so[i].order]-mean)/std;
+        d = 0;
+        if (so[i].qo > uu)
+            d = dist(so[i].qo, uu);
+        else
+        {   if(so[i].qo < ll)
+            d = dist(so[i].qo, ll);
+        }
+        lb += d;
+        cb[so[i].order] = d;
+    }
+    return lb;
+}
+
+/// Calculate Dynamic Time Wrapping distance
+/// A,B: data and query, respectively
+/// cb : cummulative bound used for early abandoning
+/// r  : size of Sakoe-Chiba warpping band
+double dtw(double* A, double* B, double *cb, int m, int r, double bsf = INF)
+{
+
+    double *cost;
+    double *cost_prev;
+    double *cost_tmp;
+    int i,j,k;
+    double x,y,z,min_cost;
+
+    /// Instead of using matrix of size O(m^2) or O(mr), we will reuse two array of size O(r).
+    cost = (double*)malloc(sizeof(double)*(2*r+1));
+    for(k=0; k<2*r+1; k++)    cost[k]=INF;
+
+    cost_prev = (double*)malloc(sizeof(double)*(2*r+1));
+    for(k=0; k<2*r+1; k++)    cost_prev[k]=INF;
+
+    for (i=0; i<m; i++)
+    {
+        k = max(0,r-i);
+        min_cost = INF;
+
+        for(j=max(0,i-r); j<=min(m-1,i+r); j++, k++)
+        {
+            /// Initialize all row and column
+            if ((i==0)&&(j==0))
+            {
+                cost[k]=dist(A[0],B[0]);
+                min_cost = cost[k];
+                continue;
+            }
+
+            if ((j-1<0)||(k-1<0))
+              y = INF;
+            else
+              y = cost[k-1];
+            if ((i-1<0)||(k+1>2*r))
+              x = INF;
+            else
+              x = cost_prev[k+1];
+            if ((i-1<0)||(j-1<0))
+              z = INF;
+            else
+              z = cost_prev[k];
+
+            /// Classic DTW calculation
+            cost[k] = min( min( x, y) , z) + dist(A[i],B[j]);
+
+            /// Find minimum cost in row for early abandoning (possibly to use column instead of row).
+            if (cost[k] < min_cost)
+            {   min_cost = cost[k];
+            }
+        }
+
+        /// We can abandon early if the current cummulative distace with lower bound together are larger than bsf
+        if (i+r < m-1 && min_cost + cb[i+r+1] >= bsf)
+        {   free(cost);
+            free(cost_prev);
+            return min_cost + cb[i+r+1];
+        }
+
+        /// Move current array to previous array.
+        cost_tmp = cost;
+        cost = cost_prev;
+        cost_prev = cost_tmp;
+    }
+    k--;
+
+    /// the DTW distance is in the last cell in the matrix of size O(m^2) or at the middle of our array.
+    double final_dtw = cost_prev[k];
+    free(cost);
+    free(cost_prev);
+    return final_dtw;
+}
+
+/***********************************************************************/
+/** DTW for fixed m and r.                                            **/
+/** The same arithmetic as dtw, in the same order, so the results     **/
+/** are identical; with the trip counts known at compile time, the    **/
+/** rows on the stack and INF sentinels at both ends of the band, the **/
+/** loops have no bound checks and can be unrolled. UCR_KERNELS lists **/
+/** the (m,r) pairs; override it at compile time, e.g.                **/
+/**   -D'UCR_KERNELS(K)=K(128,6) K(300,15)'                           **/
+/** Every other size uses the generic dtw. LB_Keogh and the envelopes **/
+/** stay generic: their loops abandon early or run over a chunk, and  **/
+/** a fixed trip count measured no faster.                            **/
+/***********************************************************************/
+
+/// R = 0.01, 0.05 and 0.1 for m = 64, 128, 256 and 512
+#ifndef UCR_KERNELS
+#define UCR_KERNELS(K) \
+    K(64,0)   K(64,3)   K(64,6) \
+    K(128,1)  K(128,6)  K(128,12) \
+    K(256,2)  K(256,12) K(256,25) \
+    K(512,5)  K(512,25) K(512,51)
+#endif
+
+/// DTW with the band of row i in cost[1..2R+1]; cost[0] and cost[2R+2] stay INF.
+/// m and r are M and R, only there to match dtw.
+template <int M, int R>
+double dtw_fixed(double* A, double* B, double *cb, int /*m*/, int /*r*/, double bsf)
+{
+    double c1[2*R+3], c2[2*R+3];
+    double *cost = c1, *cost_prev = c2, *cost_tmp;
+    double x, y, z, min_cost;
+    int i, j, k;
+
+    for (k = 0; k < 2*R+3; k++)
+        c1[k] = c2[k] = INF;
+    /// the cell before (0,0), so that its cost is dist(A[0],B[0])
+    cost_prev[R+1] = 0;
+
+    for (i = 0; i < M; i++)
+    {
+        int j0 = i-R < 0 ? 0 : i-R;
+        int j1 = i+R > M-1 ? M-1 : i+R;
+        min_cost = INF;
+        for (j = j0, k = j0-i+R+1; j <= j1; j++, k++)
+        {
+            y = cost[k-1];
+            x = cost_prev[k+1];
+            z = cost_prev[k];
+            cost[k] = min( min( x, y) , z) + dist(A[i],B[j]);
+            if (cost[k] < min_cost)
+                min_cost = cost[k];
+        }
+        if (i == 0)
+            cost_prev[R+1] = INF;
+
+        if (i+R < M-1 && min_cost + cb[i+R+1] >= bsf)
+            return min_cost + cb[i+R+1];
+
+        cost_tmp = cost;
+        cost = cost_prev;
+        cost_prev = cost_tmp;
+    }
+    return cost_prev[R+1];
+}
+
+/// The DTW kernel of one (m,r), see kernels_select
+typedef struct Kernels
+    {   double (*dtw)(double*, double*, double*, int, int, double);
+        int    fixed;      /// 1 for a specialized pair
+    } Kernels;
+
+/// The specialized DTW for (m,r) if UCR_KERNELS has it, else the generic one
+Kernels kernels_select(int m, int r)
+{
+    Kernels K = { dtw, 0 };
+#define UCR_KERNEL_CASE(M,R) \
+    if (m == M && r == R) \
+    {   K.dtw = dtw_fixed<M,R>; \
+        K.fixed = 1; \
+    }
+    UCR_KERNELS(UCR_KERNEL_CASE)
+#undef UCR_KERNEL_CASE
+    return K;
+}
+
+#endif
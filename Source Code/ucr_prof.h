@@ -0,0 +1,299 @@
+/***********************************************************************/
+/** Profiling of the stages of the search (UCR_DTW -prof).            **/
+/**                                                                   **/
+/** Every stage of the main loop is put between prof_start and        **/
+/** prof_stop, which add the elapsed time and, on Linux, the deltas   **/
+/** of a group of hardware counters opened with perf_event_open:      **/
+/** cycles, instructions, L1D read misses, LLC misses and branch      **/
+/** misses. Counters the machine or the permissions do not allow are  **/
+/** left out; without any of them only the time is reported.         **/
+/** The stages of one start take a few ns each, so the counters are   **/
+/** read in user space where the kernel allows it: rdpmc with the     **/
+/** mmap'd page of each event, and the time from the TSC with the     **/
+/** conversion on that page. Otherwise a read of the group and        **/
+/** clock_gettime, which cost a syscall per call and show up in the   **/
+/** totals of the short stages.                                       **/
+/***********************************************************************/
+
+#ifndef UCR_PROF_H
+#define UCR_PROF_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROF_RDPMC 1
+#endif
+
+/// Stages of the main loop
+#define PROF_IO        0   /// reading the data, skipping blocks, full precision re-reads
+#define PROF_ENVELOPE  1   /// envelopes and prefix sums of a chunk
+#define PROF_KIM       2
+#define PROF_PAA       3
+#define PROF_KEOGH     4
+#define PROF_KEOGH2    5   /// z-normalization and LB_Keogh on the data envelope
+#define PROF_DTW       6
+#define PROF_STAGES    7
+
+/// Counters, in this order
+#define PROF_CYCLES    0
+#define PROF_INSTR     1
+#define PROF_L1D       2
+#define PROF_LLC       3
+#define PROF_BRANCH    4
+#define PROF_EVENTS    5
+
+typedef struct Prof
+    {   int        on;                   /// 0 if profiling is off
+        int        fd[PROF_EVENTS];      /// -1 for a counter that could not be opened
+        int        slot[PROF_EVENTS];    /// position of each counter in a group read
+        int        leader, nopen;
+        int        user;                 /// 1 if all counters are read with rdpmc
+        int        tsc;                  /// 1 if the time is taken from the TSC
+#ifdef __linux__
+        struct perf_event_mmap_page *page[PROF_EVENTS];   /// NULL if not mapped
+        struct perf_event_mmap_page *clock;               /// a page with the TSC scale, see tsc
+#endif
+        unsigned long long last[PROF_EVENTS];
+        struct timespec    t0;
+        unsigned long long c0;           /// TSC at prof_start
+        unsigned long long count[PROF_STAGES][PROF_EVENTS];
+        double     time[PROF_STAGES];    /// seconds
+        long long  calls[PROF_STAGES];
+    } Prof;
+
+static const char *prof_stage_name[PROF_STAGES] = { "I/O", "Envelope", "LB_Kim", "LB_PAA", "LB_Keogh", "LB_Keogh2", "DTW" };
+
+#ifdef __linux__
+static int prof_event(int type, unsigned long long config, int group)
+{
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof(a));
+    a.size = sizeof(a);
+    a.type = type;
+    a.config = config;
+    a.disabled = group < 0;
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    a.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &a, 0, -1, group, 0);
+}
+#endif
+
+/// Switch profiling on, with the counters that can be had
+void prof_open(Prof *P)
+{
+    memset(P, 0, sizeof(Prof));
+    P->on = 1;
+    P->leader = -1;
+    for (int e = 0; e < PROF_EVENTS; e++)
+        P->fd[e] = P->slot[e] = -1;
+#ifdef __linux__
+    static const int type[PROF_EVENTS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                           PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+    static const unsigned long long config[PROF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for (int e = 0; e < PROF_EVENTS; e++)
+    {
+        P->fd[e] = prof_event(type[e], config[e], P->leader);
+        if (P->fd[e] < 0)
+            continue;
+        if (P->leader < 0)
+            P->leader = P->fd[e];
+        P->slot[e] = P->nopen++;
+    }
+    if (P->leader >= 0)
+    {   ioctl(P->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(P->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    /// User space reads need the page of every counter, and the kernel to allow rdpmc
+    P->user = P->leader >= 0;
+    for (int e = 0; e < PROF_EVENTS; e++)
+    {
+        P->page[e] = NULL;
+        if (P->fd[e] < 0)
+            continue;
+        void *m = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, P->fd[e], 0);
+        if (m != MAP_FAILED)
+            P->page[e] = (struct perf_event_mmap_page *)m;
+#ifdef PROF_RDPMC
+        P->user = P->user && P->page[e] != NULL && P->page[e]->cap_user_rdpmc;
+#else
+        P->user = 0;
+#endif
+    }
+#ifdef PROF_RDPMC
+    for (int e = 0; P->clock == NULL && e < PROF_EVENTS; e++)
+        if (P->page[e] != NULL && P->page[e]->cap_user_time)
+            P->clock = P->page[e];
+    P->tsc = P->clock != NULL;
+#endif
+#endif
+}
+
+#ifdef PROF_RDPMC
+/// The count of one event from its page, as in the perf_event_open man page; 0 if the event
+/// is not on a counter right now, then the caller reads the group instead
+static inline int prof_rdpmc(struct perf_event_mmap_page *pc, unsigned long long *v)
+{
+    unsigned int seq, idx;
+    unsigned long long count;
+    do
+    {   seq = pc->lock;
+        __asm__ __volatile__("" ::: "memory");
+        idx = pc->index;
+        count = pc->offset;
+        if (idx == 0)
+            return 0;
+        unsigned long long pmc = __rdpmc(idx-1);
+        int w = pc->pmc_width;
+        count += (unsigned long long)((long long)(pmc << (64-w)) >> (64-w));
+        __asm__ __volatile__("" ::: "memory");
+    } while (pc->lock != seq);
+    *v = count;
+    return 1;
+}
+#endif
+
+/// Read all counters of the group into v
+static inline void prof_read(Prof *P, unsigned long long *v)
+{
+    unsigned long long buf[1+PROF_EVENTS];
+#ifdef PROF_RDPMC
+    if (P->user)
+    {   unsigned long long u[PROF_EVENTS];
+        int e;
+        for (e = 0; e < PROF_EVENTS; e++)
+            if (P->fd[e] >= 0 && !prof_rdpmc(P->page[e], &u[e]))
+                break;
+        if (e == PROF_EVENTS)
+        {   for (e = 0; e < PROF_EVENTS; e++)
+                if (P->fd[e] >= 0)
+                    v[e] = u[e];
+            return;
+        }
+    }
+#endif
+    if (P->leader < 0 || read(P->leader, buf, sizeof(unsigned long long)*(1+P->nopen)) <= 0)
+        return;
+    for (int e = 0; e < PROF_EVENTS; e++)
+        if (P->slot[e] >= 0)
+            v[e] = buf[1+P->slot[e]];
+}
+
+static inline void prof_start(Prof *P)
+{
+    if (!P->on)
+        return;
+    prof_read(P, P->last);
+#ifdef PROF_RDPMC
+    if (P->tsc)
+    {   P->c0 = __rdtsc();
+        return;
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &P->t0);
+}
+
+/// Add everything since prof_start to stage s
+static inline void prof_stop(Prof *P, int s)
+{
+    if (!P->on)
+        return;
+    struct timespec t = { 0, 0 };
+    unsigned long long v[PROF_EVENTS];
+#ifdef PROF_RDPMC
+    unsigned long long c = P->tsc ? __rdtsc() : 0;
+#endif
+    if (!P->tsc)
+        clock_gettime(CLOCK_MONOTONIC, &t);
+    memcpy(v, P->last, sizeof(v));
+    prof_read(P, v);
+    for (int e = 0; e < PROF_EVENTS; e++)
+        P->count[s][e] += v[e] - P->last[e];
+#ifdef PROF_RDPMC
+    if (P->tsc)
+    {   /// TSC ticks to ns with the scale the kernel keeps on the page
+        struct perf_event_mmap_page *pc = P->clock;
+        unsigned long long d = c - P->c0, q = d >> pc->time_shift, r = d & (((unsigned long long)1 << pc->time_shift) - 1);
+        P->time[s] += (q*pc->time_mult + ((r*pc->time_mult) >> pc->time_shift))*1e-9;
+    }
+    else
+#endif
+        P->time[s] += (t.tv_sec - P->t0.tv_sec) + (t.tv_nsec - P->t0.tv_nsec)*1e-9;
+    P->calls[s]++;
+}
+
+/// Add the profile of a shard worker to the one of the coordinator
+void prof_add(Prof *P, const Prof *W)
+{
+    for (int s = 0; s < PROF_STAGES; s++)
+    {   for (int e = 0; e < PROF_EVENTS; e++)
+            P->count[s][e] += W->count[s][e];
+        P->time[s] += W->time[s];
+        P->calls[s] += W->calls[s];
+    }
+}
+
+/// Per stage: calls, time, and with counters IPC and misses per call
+void prof_report(Prof *P)
+{
+    if (!P->on)
+        return;
+    printf("\n");
+    if (P->leader < 0)
+        printf("Profile (no hardware counters, timing only)\n");
+    else
+        printf("Profile\n");
+    printf("%-10s %12s %10s %9s", "Stage", "Calls", "Time(s)", "ns/call");
+    if (P->leader >= 0)
+        printf(" %7s %10s %10s %10s %10s", "IPC", "Cyc/call", "L1D/call", "LLC/call", "Br/call");
+    printf("\n");
+    for (int s = 0; s < PROF_STAGES; s++)
+    {
+        long long c = P->calls[s];
+        if (c == 0)
+            continue;
+        printf("%-10s %12lld %10.4f %9.1f", prof_stage_name[s], c, P->time[s], P->time[s]/c*1e9);
+        if (P->leader >= 0)
+        {
+            unsigned long long *v = P->count[s];
+            if (P->slot[PROF_CYCLES] >= 0 && P->slot[PROF_INSTR] >= 0 && v[PROF_CYCLES] > 0)
+                printf(" %7.2f", (double)v[PROF_INSTR]/v[PROF_CYCLES]);
+            else
+                printf(" %7s", "n/a");
+            int show[4] = { PROF_CYCLES, PROF_L1D, PROF_LLC, PROF_BRANCH };
+            for (int k = 0; k < 4; k++)
+                if (P->slot[show[k]] >= 0)
+                    printf(" %10.2f", (double)v[show[k]]/c);
+                else
+                    printf(" %10s", "n/a");
+        }
+        printf("\n");
+    }
+}
+
+void prof_close(Prof *P)
+{
+    for (int e = 0; P->on && e < PROF_EVENTS; e++)
+        if (P->fd[e] >= 0)
+        {
+#ifdef __linux__
+            if (P->page[e] != NULL)
+                munmap(P->page[e], sysconf(_SC_PAGESIZE));
+#endif
+            close(P->fd[e]);
+        }
+}
+
+#endif